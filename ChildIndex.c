@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ChildIndex.h"
+#include "path_utils.h"
+#include "err.h"
+
+#define CHUNK_CAPACITY 256
+
+/* How full the chunks of a newly built index are. */
+#define INITIAL_CHUNK_FILL (CHUNK_CAPACITY * 3 / 4)
+
+typedef struct Chunk {
+    size_t count;
+    const char *names[CHUNK_CAPACITY];
+} Chunk;
+
+struct ChildIndex {
+    size_t size; /* Total number of names. */
+    size_t n_chunks;
+    size_t capacity; /* Length of `chunks`. */
+    Chunk **chunks; /* Non-empty chunks, sorted by their names. */
+};
+
+static Chunk *new_chunk() {
+    Chunk *chunk = (Chunk *) malloc(sizeof(Chunk));
+    if (!chunk)
+        fatal("out of memory");
+    chunk->count = 0;
+    return chunk;
+}
+
+/* Inserts `chunk` into the chunk list at `position`. */
+static void insert_chunk(ChildIndex *index, size_t position, Chunk *chunk) {
+    if (index->n_chunks == index->capacity) {
+        size_t capacity = index->capacity ? 2 * index->capacity : 4;
+        Chunk **chunks = (Chunk **) realloc(index->chunks, capacity * sizeof(Chunk *));
+        if (!chunks)
+            fatal("out of memory");
+        index->chunks = chunks;
+        index->capacity = capacity;
+    }
+    memmove(index->chunks + position + 1, index->chunks + position,
+            (index->n_chunks - position) * sizeof(Chunk *));
+    index->chunks[position] = chunk;
+    index->n_chunks++;
+}
+
+static void remove_chunk(ChildIndex *index, size_t position) {
+    free(index->chunks[position]);
+    memmove(index->chunks + position, index->chunks + position + 1,
+            (index->n_chunks - position - 1) * sizeof(Chunk *));
+    index->n_chunks--;
+}
+
+ChildIndex *child_index_new(HashMap *children) {
+    ChildIndex *index = (ChildIndex *) calloc(1, sizeof(ChildIndex));
+    if (!index)
+        fatal("out of memory");
+
+    const char **names = make_map_contents_array(children);
+    for (const char **name = names; *name; name++) {
+        if (index->n_chunks == 0 || index->chunks[index->n_chunks - 1]->count == INITIAL_CHUNK_FILL)
+            insert_chunk(index, index->n_chunks, new_chunk());
+        Chunk *chunk = index->chunks[index->n_chunks - 1];
+        chunk->names[chunk->count++] = *name;
+        index->size++;
+    }
+    free(names);
+
+    return index;
+}
+
+void child_index_free(ChildIndex *index) {
+    if (!index)
+        return;
+    for (size_t i = 0; i < index->n_chunks; i++)
+        free(index->chunks[i]);
+    free(index->chunks);
+    free(index);
+}
+
+/* Returns the last chunk whose first name isn't greater than `name`, or the first chunk. */
+static size_t find_chunk(ChildIndex *index, const char *name) {
+    size_t low = 0, high = index->n_chunks;
+    while (high - low > 1) {
+        size_t middle = (low + high) / 2;
+        if (strcmp(index->chunks[middle]->names[0], name) <= 0)
+            low = middle;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+/* Returns the position of the first name in `chunk` greater than or equal to `name`
+ * (or greater, if `strictly` is set). */
+static size_t find_in_chunk(Chunk *chunk, const char *name, bool strictly) {
+    size_t low = 0, high = chunk->count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        int cmp = strcmp(chunk->names[middle], name);
+        if (cmp < 0 || (strictly && cmp == 0))
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+void child_index_insert(ChildIndex *index, const char *name) {
+    if (index->n_chunks == 0)
+        insert_chunk(index, 0, new_chunk());
+
+    size_t c = find_chunk(index, name);
+    Chunk *chunk = index->chunks[c];
+
+    if (chunk->count == CHUNK_CAPACITY) {
+        /* Splitting a full chunk in halves. */
+        Chunk *upper = new_chunk();
+        upper->count = CHUNK_CAPACITY / 2;
+        chunk->count -= upper->count;
+        memcpy(upper->names, chunk->names + chunk->count, upper->count * sizeof(char *));
+        insert_chunk(index, c + 1, upper);
+        if (strcmp(upper->names[0], name) <= 0)
+            chunk = upper;
+    }
+
+    size_t position = find_in_chunk(chunk, name, false);
+    memmove(chunk->names + position + 1, chunk->names + position,
+            (chunk->count - position) * sizeof(char *));
+    chunk->names[position] = name;
+    chunk->count++;
+    index->size++;
+}
+
+void child_index_remove(ChildIndex *index, const char *name) {
+    if (index->n_chunks == 0)
+        return;
+
+    size_t c = find_chunk(index, name);
+    Chunk *chunk = index->chunks[c];
+    size_t position = find_in_chunk(chunk, name, false);
+    if (position == chunk->count || strcmp(chunk->names[position], name) != 0)
+        return;
+
+    chunk->count--;
+    memmove(chunk->names + position, chunk->names + position + 1,
+            (chunk->count - position) * sizeof(char *));
+    index->size--;
+
+    if (chunk->count == 0) {
+        remove_chunk(index, c);
+    }
+    else if (c + 1 < index->n_chunks
+             && chunk->count + index->chunks[c + 1]->count <= CHUNK_CAPACITY / 2) {
+        /* Merging sparse neighbours, so that chunks stay reasonably full. */
+        Chunk *next = index->chunks[c + 1];
+        memcpy(chunk->names + chunk->count, next->names, next->count * sizeof(char *));
+        chunk->count += next->count;
+        remove_chunk(index, c + 1);
+    }
+}
+
+size_t child_index_size(ChildIndex *index) {
+    return index->size;
+}
+
+ChildIndexCursor child_index_seek(ChildIndex *index, const char *after) {
+    ChildIndexCursor cursor = { 0, 0 };
+    if (after && index->n_chunks > 0) {
+        cursor.chunk = find_chunk(index, after);
+        cursor.position = find_in_chunk(index->chunks[cursor.chunk], after, true);
+    }
+    return cursor;
+}
+
+const char *child_index_next(ChildIndex *index, ChildIndexCursor *cursor) {
+    while (cursor->chunk < index->n_chunks && cursor->position >= index->chunks[cursor->chunk]->count) {
+        cursor->chunk++;
+        cursor->position = 0;
+    }
+    if (cursor->chunk >= index->n_chunks)
+        return NULL;
+    return index->chunks[cursor->chunk]->names[cursor->position++];
+}
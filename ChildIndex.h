@@ -0,0 +1,40 @@
+#ifndef CHILDINDEX_H
+#define CHILDINDEX_H
+
+#include <stddef.h>
+#include "HashMap.h"
+
+/* The names of the children of a node in lexicographic order.
+ * Names are kept in chunks of a bounded size, so inserting or removing one moves at most
+ * a chunk of names. The index doesn't copy names: they belong to the children map, and a name
+ * must be removed from the index before it's removed from the map. */
+typedef struct ChildIndex ChildIndex;
+
+/* A position in the index. */
+typedef struct ChildIndexCursor {
+    size_t chunk;
+    size_t position;
+} ChildIndexCursor;
+
+/* Creates an index of all the keys of `children`. */
+ChildIndex *child_index_new(HashMap *children);
+
+void child_index_free(ChildIndex *index);
+
+/* Adds `name`, which must not be in the index yet. */
+void child_index_insert(ChildIndex *index, const char *name);
+
+/* Removes `name` if it's in the index. */
+void child_index_remove(ChildIndex *index, const char *name);
+
+/* Returns the number of names in the index. */
+size_t child_index_size(ChildIndex *index);
+
+/* Returns a cursor to the first name greater than `after`,
+ * or to the first name if `after` is NULL. */
+ChildIndexCursor child_index_seek(ChildIndex *index, const char *after);
+
+/* Returns the name at `cursor` and moves it forward, or returns NULL if there are no more. */
+const char *child_index_next(ChildIndex *index, ChildIndexCursor *cursor);
+
+#endif //CHILDINDEX_H
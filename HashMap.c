@@ -1,101 +1,372 @@
 #include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "HashMap.h"
+#include "epoch.h"
+
+// An open-addressing hash table in the style of Swiss tables.
+// Every slot has a control byte: either EMPTY, DELETED (a tombstone), or the low
+// 7 bits of the key's hash (H2) if the slot is full. Slots are probed in groups
+// of GROUP_WIDTH control bytes, which are matched against H2 all at once.
+//
+// Lookups may run concurrently with a writer inside an epoch critical section
+// (see epoch.h). Every slot points to an immutable pair holding both the key and
+// the value, which is published with a single atomic store before the slot's
+// control byte, and cleared before the control byte of a removed entry. Control bytes
+// are atomic too, and read a group at a time with two relaxed 8-byte loads. Replaced
+// tables and removed pairs are retired instead of freed. A control byte is only
+// a hint: a lookup compares the key of the pair it loads from the slot, so a slot
+// being reused for another key meanwhile can't make it return a wrong value.
+
+#define GROUP_WIDTH 16
+
+// Smallest non-zero capacity. Capacities are powers of two, multiples of GROUP_WIDTH.
+#define MIN_CAPACITY GROUP_WIDTH
 
-// We fix the number of hash buckets for simplicity.
-#define N_BUCKETS 8
+#define CTRL_EMPTY ((int8_t)-128) // 0b10000000
+#define CTRL_DELETED ((int8_t)-2) // 0b11111110
 
 typedef struct Pair Pair;
 
 struct Pair {
-    char* key;
     void* value;
-    Pair* next; // Next item in a single-linked list.
+    char key[];
+};
+
+typedef struct Table Table;
+
+struct Table {
+    size_t capacity; // Number of slots.
+    Pair* _Atomic* slots; // NULL where the control byte is EMPTY or DELETED, or about to be.
+    _Atomic int8_t ctrl[]; // Control bytes, one per slot, followed by the slots.
 };
 
+// Groups start at multiples of GROUP_WIDTH, so they can be loaded as whole words.
+static_assert(offsetof(Table, ctrl) % sizeof(uint64_t) == 0, "control bytes must be aligned");
+
 struct HashMap {
-    Pair* buckets[N_BUCKETS]; // Linked lists of key-value pairs.
-    size_t size; // total number of entries in map.
+    Table* _Atomic table; // NULL while the map has no capacity.
+    size_t size; // Total number of entries in map.
+    size_t growth_left; // Number of EMPTY slots that can be filled before resizing.
 };
 
-static unsigned int get_hash(const char* key);
+static uint64_t get_hash(const char* key);
+
+// Bit i of a mask refers to the i-th slot of a group.
+typedef uint32_t GroupMask;
+
+// A control byte, as seen by a lookup or the writer.
+static inline int8_t load_ctrl(const _Atomic int8_t* ctrl)
+{
+    return atomic_load_explicit(ctrl, memory_order_relaxed);
+}
+
+static inline void store_ctrl(_Atomic int8_t* ctrl, int8_t value)
+{
+    atomic_store_explicit(ctrl, value, memory_order_relaxed);
+}
+
+#ifdef __SSE2__
+// The control bytes of a group, which the writer may be changing meanwhile.
+static inline __m128i load_group(const _Atomic int8_t* group)
+{
+    const _Atomic uint64_t* words = (const _Atomic uint64_t*)group;
+    uint64_t low = atomic_load_explicit(&words[0], memory_order_relaxed);
+    uint64_t high = atomic_load_explicit(&words[1], memory_order_relaxed);
+    return _mm_set_epi64x((long long)high, (long long)low);
+}
+#endif
+
+static inline GroupMask group_match(const _Atomic int8_t* group, int8_t h2)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(load_group(group), _mm_set1_epi8(h2)));
+#else
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; ++i)
+        if (load_ctrl(&group[i]) == h2)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+// Both EMPTY and DELETED have the sign bit set, full slots don't.
+static inline GroupMask group_match_empty_or_deleted(const _Atomic int8_t* group)
+{
+#ifdef __SSE2__
+    return _mm_movemask_epi8(load_group(group));
+#else
+    GroupMask mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; ++i)
+        if (load_ctrl(&group[i]) < 0)
+            mask |= 1u << i;
+    return mask;
+#endif
+}
+
+static inline GroupMask group_match_empty(const _Atomic int8_t* group)
+{
+    return group_match(group, CTRL_EMPTY);
+}
+
+static inline size_t hash_h1(uint64_t hash)
+{
+    return hash >> 7;
+}
+
+static inline int8_t hash_h2(uint64_t hash)
+{
+    return hash & 0x7f;
+}
+
+// Groups are visited in triangular order, which covers every group of a
+// power-of-two table exactly once.
+typedef struct {
+    size_t group;
+    size_t mask;
+    size_t step;
+} Probe;
+
+static inline Probe probe_start(const Table* table, uint64_t hash)
+{
+    size_t mask = table->capacity / GROUP_WIDTH - 1;
+    Probe probe = { hash_h1(hash) & mask, mask, 0 };
+    return probe;
+}
+
+static inline void probe_next(Probe* probe)
+{
+    probe->step++;
+    probe->group = (probe->group + probe->step) & probe->mask;
+}
+
+static inline size_t max_load(size_t capacity)
+{
+    return capacity - capacity / 8;
+}
+
+// The table of a map, as seen by its writer.
+static inline Table* get_table(const HashMap* map)
+{
+    return atomic_load_explicit(&map->table, memory_order_relaxed);
+}
+
+// The pair in a slot, as seen by the writer.
+static inline Pair* get_pair(const Table* table, size_t index)
+{
+    return atomic_load_explicit(&table->slots[index], memory_order_relaxed);
+}
 
 HashMap* hmap_new()
 {
     HashMap* map = malloc(sizeof(HashMap));
     if (!map)
         return NULL;
-    memset(map, 0, sizeof(HashMap));
+    atomic_init(&map->table, NULL);
+    map->size = 0;
+    map->growth_left = 0;
     return map;
 }
 
-void hmap_free(HashMap* map)
+void hmap_clear(HashMap* map)
 {
-    for (int h = 0; h < N_BUCKETS; ++h) {
-        for (Pair* p = map->buckets[h]; p;) {
-            Pair* q = p;
-            p = p->next;
-            free(q->key);
-            free(q);
+    Table* table = get_table(map);
+    if (table) {
+        for (size_t i = 0; i < table->capacity; ++i) {
+            if (load_ctrl(&table->ctrl[i]) >= 0)
+                free(get_pair(table, i));
         }
+        free(table);
     }
+    atomic_store_explicit(&map->table, NULL, memory_order_relaxed);
+    map->size = 0;
+    map->growth_left = 0;
+}
+
+void hmap_free(HashMap* map)
+{
+    hmap_clear(map);
     free(map);
 }
 
-static Pair* hmap_find(HashMap* map, int h, const char* key)
+// Return the pair of `table` holding the `length` bytes of `key`, setting `*index`
+// to its slot, or NULL if there is none.
+static Pair* hmap_find_length(const Table* table, uint64_t hash, const char* key, size_t length,
+                              size_t* index)
+{
+    if (!table)
+        return NULL;
+    int8_t h2 = hash_h2(hash);
+    for (Probe probe = probe_start(table, hash);; probe_next(&probe)) {
+        const _Atomic int8_t* group = table->ctrl + probe.group * GROUP_WIDTH;
+        GroupMask match = group_match(group, h2);
+        atomic_thread_fence(memory_order_acquire); // Pairs with publish_slot.
+        for (GroupMask m = match; m; m &= m - 1) {
+            size_t i = probe.group * GROUP_WIDTH + __builtin_ctz(m);
+            Pair* pair = atomic_load_explicit(&table->slots[i], memory_order_acquire);
+            if (pair && strncmp(key, pair->key, length) == 0 && pair->key[length] == '\0') {
+                *index = i;
+                return pair;
+            }
+        }
+        if (group_match_empty(group))
+            return NULL;
+        if (probe.step == probe.mask)
+            return NULL; // Every group has been visited.
+    }
+}
+
+// Return the pair of `table` holding `key`, setting `*index` to its slot, or NULL if there is none.
+static Pair* hmap_find(const Table* table, uint64_t hash, const char* key, size_t* index)
+{
+    return hmap_find_length(table, hash, key, strlen(key), index);
+}
+
+// Return the index of the first EMPTY or DELETED slot in the probe sequence of `hash`.
+// The table must have at least one such slot.
+static size_t find_insert_slot(const Table* table, uint64_t hash)
+{
+    for (Probe probe = probe_start(table, hash);; probe_next(&probe)) {
+        GroupMask m = group_match_empty_or_deleted(table->ctrl + probe.group * GROUP_WIDTH);
+        if (m)
+            return probe.group * GROUP_WIDTH + __builtin_ctz(m);
+    }
+}
+
+// Make a filled slot visible to concurrent lookups.
+static inline void publish_slot(Table* table, size_t index, Pair* pair, int8_t h2)
+{
+    atomic_store_explicit(&table->slots[index], pair, memory_order_release);
+    atomic_thread_fence(memory_order_release);
+    store_ctrl(&table->ctrl[index], h2);
+}
+
+// Replace the table with a new one of `new_capacity` slots, dropping all tombstones.
+static bool hmap_rehash(HashMap* map, size_t new_capacity)
 {
-    for (Pair* p = map->buckets[h]; p; p = p->next) {
-        if (strcmp(key, p->key) == 0)
-            return p;
+    Table* old_table = get_table(map);
+
+    // Control bytes and slots share the allocation of the table. Capacities are multiples
+    // of GROUP_WIDTH, so the slots are aligned.
+    Table* table = malloc(sizeof(Table) + new_capacity * (sizeof(int8_t) + sizeof(Pair*)));
+    if (!table)
+        return false;
+    table->capacity = new_capacity;
+    table->slots = (Pair* _Atomic*)(table->ctrl + new_capacity);
+    for (size_t i = 0; i < new_capacity; ++i) {
+        atomic_init(&table->ctrl[i], CTRL_EMPTY);
+        atomic_init(&table->slots[i], NULL);
     }
-    return NULL;
+
+    if (old_table) {
+        for (size_t i = 0; i < old_table->capacity; ++i) {
+            if (load_ctrl(&old_table->ctrl[i]) < 0)
+                continue;
+            Pair* pair = get_pair(old_table, i);
+            uint64_t hash = get_hash(pair->key);
+            size_t index = find_insert_slot(table, hash);
+            atomic_init(&table->ctrl[index], hash_h2(hash));
+            atomic_init(&table->slots[index], pair);
+        }
+    }
+
+    atomic_store_explicit(&map->table, table, memory_order_release);
+    map->growth_left = max_load(new_capacity) - map->size;
+    if (old_table)
+        epoch_retire(old_table, free);
+    return true;
 }
 
 void* hmap_get(HashMap* map, const char* key)
 {
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
-    if (p)
-        return p->value;
-    else
-        return NULL;
+    Table* table = atomic_load_explicit(&map->table, memory_order_acquire);
+    size_t index;
+    Pair* pair = hmap_find(table, get_hash(key), key, &index);
+    return pair ? pair->value : NULL;
+}
+
+void* hmap_get_hashed(HashMap* map, const char* key, size_t length, uint64_t hash)
+{
+    Table* table = atomic_load_explicit(&map->table, memory_order_acquire);
+    size_t index;
+    Pair* pair = hmap_find_length(table, hash, key, length, &index);
+    return pair ? pair->value : NULL;
+}
+
+const char* hmap_get_key(HashMap* map, const char* key)
+{
+    size_t index;
+    Pair* pair = hmap_find(get_table(map), get_hash(key), key, &index);
+    return pair ? pair->key : NULL;
 }
 
 bool hmap_insert(HashMap* map, const char* key, void* value)
 {
     if (!value)
         return false;
-    int h = get_hash(key);
-    Pair* p = hmap_find(map, h, key);
-    if (p)
+    uint64_t hash = get_hash(key);
+    Table* table = get_table(map);
+    size_t index;
+    if (hmap_find(table, hash, key, &index))
         return false; // Already exists.
-    Pair* new_p = malloc(sizeof(Pair));
-    new_p->key = strdup(key);
-    new_p->value = value;
-    new_p->next = map->buckets[h];
-    map->buckets[h] = new_p;
+
+    index = table ? find_insert_slot(table, hash) : 0;
+    if (!table || (map->growth_left == 0 && load_ctrl(&table->ctrl[index]) == CTRL_EMPTY)) {
+        // Grow, unless most of the used-up slots are just tombstones.
+        size_t new_capacity = table ? table->capacity : MIN_CAPACITY;
+        if (map->size + 1 > max_load(new_capacity) / 2)
+            new_capacity *= 2;
+        if (!hmap_rehash(map, new_capacity))
+            return false;
+        table = get_table(map);
+        index = find_insert_slot(table, hash);
+    }
+
+    size_t key_size = strlen(key) + 1;
+    Pair* pair = malloc(sizeof(Pair) + key_size);
+    if (!pair)
+        return false;
+    pair->value = value;
+    memcpy(pair->key, key, key_size);
+    if (load_ctrl(&table->ctrl[index]) == CTRL_EMPTY)
+        map->growth_left--;
+    publish_slot(table, index, pair, hash_h2(hash));
     map->size++;
     return true;
 }
 
 bool hmap_remove(HashMap* map, const char* key)
 {
-    int h = get_hash(key);
-    Pair** pp = &(map->buckets[h]);
-    while (*pp) {
-        Pair* p = *pp;
-        if (strcmp(key, p->key) == 0) {
-            *pp = p->next;
-            free(p->key);
-            free(p);
-            map->size--;
-            return true;
-        }
-        pp = &(p->next);
+    Table* table = get_table(map);
+    size_t index;
+    Pair* pair = hmap_find(table, get_hash(key), key, &index);
+    if (!pair)
+        return false;
+
+    // Cleared first, so that a lookup that still sees the control byte finds no pair.
+    atomic_store_explicit(&table->slots[index], NULL, memory_order_relaxed);
+
+    // A lookup stops at the first group with an EMPTY slot, so if this group
+    // already has one, no probe sequence continues past it and the slot can be
+    // made EMPTY again. Otherwise a tombstone is needed.
+    const _Atomic int8_t* group = table->ctrl + (index & ~(size_t)(GROUP_WIDTH - 1));
+    if (group_match_empty(group)) {
+        store_ctrl(&table->ctrl[index], CTRL_EMPTY);
+        map->growth_left++;
+    } else {
+        store_ctrl(&table->ctrl[index], CTRL_DELETED);
     }
-    return false;
+    epoch_retire(pair, free);
+    map->size--;
+    return true;
 }
 
 size_t hmap_size(HashMap* map)
@@ -105,30 +376,59 @@ size_t hmap_size(HashMap* map)
 
 HashMapIterator hmap_iterator(HashMap* map)
 {
-    HashMapIterator it = { 0, map->buckets[0] };
+    HashMapIterator it = { 0, atomic_load_explicit(&map->table, memory_order_acquire) };
     return it;
 }
 
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value)
 {
-    Pair* p = it->pair;
-    while (!p && it->bucket < N_BUCKETS - 1) {
-        p = map->buckets[++it->bucket];
-    }
-    if (!p)
+    (void)map;
+    const Table* table = it->table;
+    if (!table)
         return false;
-    *key = p->key;
-    *value = p->value;
-    it->pair = p->next;
-    return true;
+    for (; it->slot < table->capacity; it->slot++) {
+        if (load_ctrl(&table->ctrl[it->slot]) < 0)
+            continue;
+        atomic_thread_fence(memory_order_acquire); // Pairs with publish_slot.
+        Pair* pair = atomic_load_explicit(&table->slots[it->slot], memory_order_acquire);
+        if (!pair)
+            continue; // Being removed.
+        *key = pair->key;
+        *value = pair->value;
+        it->slot++;
+        return true;
+    }
+    return false;
 }
 
-static unsigned int get_hash(const char* key)
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
 {
-    unsigned int hash = 17;
-    while (*key) {
-        hash = (hash << 3) + hash + *key;
-        ++key;
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static uint64_t get_hash(const char* key)
+{
+    return hmap_hash(key, strlen(key));
+}
+
+// A multiply-mix hash consuming the key 8 bytes at a time.
+uint64_t hmap_hash(const char* key, size_t len)
+{
+    const uint64_t k0 = 0xa0761d6478bd642full;
+    const uint64_t k1 = 0xe7037ed1a0b428dbull;
+    uint64_t hash = k0 ^ len;
+    while (len >= 8) {
+        uint64_t chunk;
+        memcpy(&chunk, key, 8);
+        hash = hash_mix(hash ^ chunk, k1);
+        key += 8;
+        len -= 8;
+    }
+    if (len) {
+        uint64_t chunk = 0;
+        memcpy(&chunk, key, len);
+        hash = hash_mix(hash ^ chunk, k1);
     }
-    return hash % N_BUCKETS;
+    return hash_mix(hash, k0 ^ k1);
 }
@@ -1,5 +1,6 @@
 #pragma once
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 // A structure representing a mapping from keys to values.
@@ -14,9 +15,28 @@ HashMap* hmap_new();
 // copied by hmap_insert, but does not free any values.
 void hmap_free(HashMap* map);
 
+// Remove all entries and free the keys and the table, but keep the map itself,
+// so that it can be reused. Does not free any values.
+void hmap_clear(HashMap* map);
+
 // Get the value stored under `key`, or NULL if not present.
+// May run without locks, concurrently with a single writer, inside an epoch critical section
+// (see epoch.h). It then returns the value that was stored under `key` at some moment during
+// the call, or NULL if there was a moment when `key` wasn't present. Writers still have to be
+// serialized with each other.
 void* hmap_get(HashMap* map, const char* key);
 
+// Return the hash the map uses for the first `length` bytes of `key`.
+uint64_t hmap_hash(const char* key, size_t length);
+
+// Like `hmap_get`, but for a key given by its first `length` bytes, which need not be
+// null-terminated, and its `hmap_hash`.
+void* hmap_get_hashed(HashMap* map, const char* key, size_t length, uint64_t hash);
+
+// Get the map's own copy of `key`, or NULL if not present.
+// The copy stays valid until `key` is removed from the map.
+const char* hmap_get_key(HashMap* map, const char* key);
+
 // Insert a `value` under `key` and return true,
 // or do nothing and return false if `key` already exists in the map.
 // `value` must not be NULL.
@@ -40,7 +60,10 @@ HashMapIterator hmap_iterator(HashMap* map);
 // If there are no more elements, leaves `*key` and `*value` unchanged and
 // returns false.
 //
-// The map cannot be modified between calls to `hmap_iterator` and `hmap_next`.
+// The map cannot be modified between calls to `hmap_iterator` and `hmap_next`,
+// except by a concurrent writer while iterating inside an epoch critical section (see epoch.h).
+// Such an iteration sees every entry that is neither inserted nor removed meanwhile exactly once,
+// and may or may not see the others.
 //
 // Usage: ```
 //     const char* key;
@@ -52,6 +75,6 @@ HashMapIterator hmap_iterator(HashMap* map);
 bool hmap_next(HashMap* map, HashMapIterator* it, const char** key, void** value);
 
 struct HashMapIterator {
-    int bucket;
-    void* pair;
+    size_t slot;
+    const void* table; // The table being iterated over, even if it's replaced meanwhile.
 };
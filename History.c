@@ -0,0 +1,165 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "History.h"
+#include "HashMap.h"
+#include "path_utils.h"
+#include "epoch.h"
+#include "err.h"
+
+/* The history of a node is a list of events, the newest first. Events are only added
+ * by writers of the node, before they modify its children, so a reader that sees the effect
+ * of a change in the children also sees its event. The children at some time are then
+ * the current children with all the later events undone. */
+
+struct Stamp {
+    unsigned long time;
+    atomic_int refs; /* Events that refer to the stamp, and its change until it ends. */
+};
+
+struct ChildEvent {
+    Stamp *stamp;
+    Node *child;
+    bool attached;
+    _Atomic(ChildEvent *) older;
+    char name[];
+};
+
+Stamp *stamp_new(unsigned long time) {
+    Stamp *stamp = (Stamp *) malloc(sizeof(Stamp));
+    if (!stamp)
+        fatal("out of memory");
+    stamp->time = time;
+    atomic_init(&stamp->refs, 1);
+    return stamp;
+}
+
+void stamp_release(Stamp *stamp) {
+    if (atomic_fetch_sub(&stamp->refs, 1) == 1)
+        free(stamp);
+}
+
+static unsigned long event_time(ChildEvent *event) {
+    return event->stamp->time;
+}
+
+void history_free(ChildEvent *history) {
+    while (history) {
+        ChildEvent *older = atomic_load_explicit(&history->older, memory_order_relaxed);
+        stamp_release(history->stamp);
+        free(history);
+        history = older;
+    }
+}
+
+static void free_events(void *history) {
+    history_free((ChildEvent *) history);
+}
+
+void history_record(Node *node, Stamp *stamp, const char *name, Node *child, bool attached) {
+    size_t length = strlen(name);
+    ChildEvent *event = (ChildEvent *) malloc(sizeof(ChildEvent) + length + 1);
+    if (!event)
+        fatal("out of memory");
+    memcpy(event->name, name, length + 1);
+    event->stamp = stamp;
+    event->child = child;
+    event->attached = attached;
+    atomic_fetch_add(&stamp->refs, 1);
+
+    atomic_init(&event->older, atomic_load_explicit(&node->history, memory_order_relaxed));
+    atomic_store_explicit(&node->history, event, memory_order_release);
+
+    /* Orders the event before the modification of the children that follows. */
+    atomic_thread_fence(memory_order_release);
+}
+
+void history_trim(Node *node, unsigned long oldest) {
+    /* Events are stamped in the order they're recorded in, so the old ones form a suffix. */
+    _Atomic(ChildEvent *) *link = &node->history;
+    ChildEvent *event = atomic_load_explicit(link, memory_order_relaxed);
+    while (event && event_time(event) >= oldest) {
+        link = &event->older;
+        event = atomic_load_explicit(link, memory_order_relaxed);
+    }
+
+    if (event) {
+        atomic_store_explicit(link, NULL, memory_order_release);
+        epoch_retire(event, free_events);
+    }
+}
+
+/* Returns the earliest event of `node` about `name` that happened after `time`, or NULL.
+ * The children of `node` have to be read before. */
+static ChildEvent *first_event_after(Node *node, const char *name, unsigned long time) {
+    ChildEvent *first = NULL;
+
+    atomic_thread_fence(memory_order_acquire);
+    for (ChildEvent *event = atomic_load_explicit(&node->history, memory_order_acquire);
+         event && event_time(event) > time;
+         event = atomic_load_explicit(&event->older, memory_order_acquire)) {
+        if (strcmp(event->name, name) == 0)
+            first = event;
+    }
+
+    return first;
+}
+
+Node *history_get(Node *node, const char *name, unsigned long time) {
+    Node *child = (Node *) hmap_get(node->children, name);
+
+    /* Whatever has changed under `name` since `time` is undone by its first event. */
+    ChildEvent *event = first_event_after(node, name, time);
+    if (event)
+        return event->attached ? NULL : event->child;
+    return child;
+}
+
+HashMap *history_children(Node *node, unsigned long time) {
+    HashMap *children = hmap_new();
+    if (!children)
+        fatal("out of memory");
+
+    const char *key;
+    void *value;
+    HashMapIterator it = hmap_iterator(node->children);
+    while (hmap_next(node->children, &it, &key, &value))
+        hmap_insert(children, key, value);
+
+    /* Undoing the later events, the earliest one last, so that it decides. */
+    atomic_thread_fence(memory_order_acquire);
+    ChildEvent *later[2];
+    size_t n_later = 0, capacity = 2;
+    ChildEvent **events = later;
+    for (ChildEvent *event = atomic_load_explicit(&node->history, memory_order_acquire);
+         event && event_time(event) > time;
+         event = atomic_load_explicit(&event->older, memory_order_acquire)) {
+        if (n_later == capacity) {
+            capacity *= 2;
+            ChildEvent **grown = (ChildEvent **) malloc(capacity * sizeof(ChildEvent *));
+            if (!grown)
+                fatal("out of memory");
+            memcpy(grown, events, n_later * sizeof(ChildEvent *));
+            if (events != later)
+                free(events);
+            events = grown;
+        }
+        events[n_later++] = event;
+    }
+    for (size_t i = 0; i < n_later; i++) {
+        hmap_remove(children, events[i]->name);
+        if (!events[i]->attached)
+            hmap_insert(children, events[i]->name, events[i]->child);
+    }
+    if (events != later)
+        free(events);
+
+    return children;
+}
+
+char *history_list(Node *node, unsigned long time) {
+    HashMap *children = history_children(node, time);
+    char *string = make_map_contents_string(children);
+    hmap_free(children);
+    return string;
+}
@@ -0,0 +1,47 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdbool.h>
+#include "Node.h"
+
+/* Changes of the children of nodes, recorded while snapshots of the tree exist, so that the
+ * children a node had at the time of a snapshot can be recovered without locking it.
+ * Times are values of a tree-wide clock. A snapshot sees exactly the changes stamped with
+ * an earlier time. */
+
+/* The time of a single change of the tree, which may attach and detach children of several
+ * nodes at once. It's freed once its change has ended and no event refers to it. */
+typedef struct Stamp Stamp;
+
+/* Creates a stamp for a change that begins at `time`. */
+Stamp *stamp_new(unsigned long time);
+
+/* Drops the change's reference to its stamp, once it has ended. */
+void stamp_release(Stamp *stamp);
+
+/* Records that `child` is about to be attached to `node` under `name` (or detached from it)
+ * by the change stamped with `stamp`. The caller must have write access to `node`
+ * and make the change only after recording it. */
+void history_record(Node *node, Stamp *stamp, const char *name, Node *child, bool attached);
+
+/* Drops the events of `node` that happened before `oldest`. No snapshot earlier than `oldest`
+ * may exist anymore. The caller must have write access to `node`. */
+void history_trim(Node *node, unsigned long oldest);
+
+/* Frees the history of a node no process can be reading. */
+void history_free(ChildEvent *history);
+
+/* Returns the child `node` had under `name` at `time`, or NULL if there was none.
+ * Must be called within an epoch critical section, and no change of `node` made after `time`
+ * may have been dropped from its history. */
+Node *history_get(Node *node, const char *name, unsigned long time);
+
+/* Returns a new map of the children `node` had at `time`, by their names.
+ * The same requirements as for `history_get` apply. The caller should free the map. */
+HashMap *history_children(Node *node, unsigned long time);
+
+/* Returns the names of the children `node` had at `time`, sorted and comma-separated.
+ * The same requirements as for `history_get` apply. The caller should free the result. */
+char *history_list(Node *node, unsigned long time);
+
+#endif //HISTORY_H
@@ -0,0 +1,475 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Journal.h"
+#include "path_utils.h"
+#include "err.h"
+
+/* Every change is stored as a header followed by its null-terminated paths. */
+typedef struct EntryHeader {
+    uint32_t size; /* Of the paths. */
+    uint32_t checksum; /* Of the rest of the header and the paths. */
+    uint64_t time;
+    uint32_t op;
+    uint32_t reserved;
+} EntryHeader;
+
+struct Journal {
+    char *path;
+    int fd;
+
+    pthread_mutex_t lock;
+    pthread_cond_t round_done; /* Signaled when a round of writing ends. */
+
+    char *buffer; /* Changes appended since the last round began. */
+    size_t size;
+    size_t capacity;
+    char *spare; /* Changes being written by the current round. */
+    size_t spare_capacity;
+
+    uint64_t appended; /* Tickets handed out. */
+    uint64_t durable; /* Tickets whose changes are durable. */
+    bool writing; /* Whether a round is in progress. */
+
+    pthread_mutex_t compact_lock; /* Serializes compactions. */
+};
+
+static void lock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_lock(mutex) != 0)
+        syserr("lock failed");
+}
+
+static void unlock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_unlock(mutex) != 0)
+        syserr("unlock failed");
+}
+
+/* FNV-1a. */
+static uint32_t checksum(uint32_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+static uint32_t entry_checksum(const EntryHeader *header, const char *paths) {
+    uint32_t hash = checksum(2166136261u, &header->time, sizeof(EntryHeader) - offsetof(EntryHeader, time));
+    return checksum(hash, paths, header->size);
+}
+
+/* Reads the entry at `*offset` of `data`, and moves `*offset` past it.
+ * Returns false if there's no complete, valid entry there. */
+static bool read_entry(const char *data, size_t size, size_t *offset, JournalEntry *entry) {
+    EntryHeader header;
+    if (size - *offset < sizeof(header))
+        return false;
+    memcpy(&header, data + *offset, sizeof(header));
+    const char *paths = data + *offset + sizeof(header);
+    if (header.size == 0 || header.size > size - *offset - sizeof(header)
+        || paths[header.size - 1] != '\0' || header.checksum != entry_checksum(&header, paths))
+        return false;
+
+    entry->time = header.time;
+    entry->op = (JournalOp) header.op;
+    entry->path = paths;
+    entry->target = NULL;
+    size_t path_size = strlen(paths) + 1;
+    if (path_size < header.size)
+        entry->target = paths + path_size;
+
+    bool has_target = entry->op == JOURNAL_MOVE;
+    if (entry->op < JOURNAL_CREATE || entry->op > JOURNAL_CREATE_ALL || has_target != (entry->target != NULL)
+        || !is_path_valid(entry->path) || (has_target && !is_path_valid(entry->target)))
+        return false;
+
+    *offset += sizeof(header) + header.size;
+    return true;
+}
+
+/* Writes the whole buffer, unless an error occurs. Returns 0 or the error code. */
+static int write_all(int fd, const void *buffer, size_t size) {
+    const char *data = (const char *) buffer;
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return errno;
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/* Reads `size` bytes of the file from `offset`. The caller should free the result.
+ * Returns NULL and sets errno on failure. */
+static char *read_range(int fd, size_t offset, size_t size) {
+    char *data = (char *) malloc(size + 1);
+    if (!data)
+        fatal("out of memory");
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, data + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            int error = n < 0 ? errno : EIO;
+            free(data);
+            errno = error;
+            return NULL;
+        }
+        done += n;
+    }
+    return data;
+}
+
+/* Reads the whole file. The caller should free the result. */
+static char *read_all(int fd, size_t *size) {
+    struct stat file;
+    if (fstat(fd, &file) != 0)
+        return NULL;
+    *size = file.st_size;
+    return read_range(fd, 0, *size);
+}
+
+/* Makes a renamed or created file at `path` durable. */
+static int sync_directory(const char *path) {
+    char *directory = strdup(path);
+    if (!directory)
+        fatal("out of memory");
+    char *slash = strrchr(directory, '/');
+    if (slash == directory)
+        slash[1] = '\0';
+    else if (slash)
+        *slash = '\0';
+    else
+        strcpy(directory, ".");
+
+    int result = 0;
+    int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if (fd < 0 || fsync(fd) != 0)
+        result = errno;
+    if (fd >= 0)
+        close(fd);
+    free(directory);
+    return result;
+}
+
+static int compare_times(const void *a, const void *b) {
+    unsigned long time_a = ((const JournalEntry *) a)->time;
+    unsigned long time_b = ((const JournalEntry *) b)->time;
+    return (time_a > time_b) - (time_a < time_b);
+}
+
+Journal *journal_open(const char *path, unsigned long after, JournalReplay replay, void *arg,
+                      unsigned long *last) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return NULL;
+
+    size_t size;
+    char *data = read_all(fd, &size);
+    if (!data) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+
+    /* Changes are appended in batches, out of the order of their times, so they're sorted
+     * before they're replayed. */
+    size_t count = 0, capacity = 64, offset = 0;
+    JournalEntry *entries = (JournalEntry *) malloc(capacity * sizeof(JournalEntry));
+    if (!entries)
+        fatal("out of memory");
+    JournalEntry entry;
+    *last = after;
+    while (read_entry(data, size, &offset, &entry)) {
+        if (entry.time <= after)
+            continue;
+        if (count == capacity) {
+            capacity *= 2;
+            entries = (JournalEntry *) realloc(entries, capacity * sizeof(JournalEntry));
+            if (!entries)
+                fatal("out of memory");
+        }
+        entries[count++] = entry;
+        if (entry.time > *last)
+            *last = entry.time;
+    }
+    qsort(entries, count, sizeof(JournalEntry), compare_times);
+    for (size_t i = 0; i < count; i++)
+        replay(arg, &entries[i]);
+    free(entries);
+    free(data);
+
+    /* Dropping whatever a crash left after the last complete change. */
+    if (offset < size && (ftruncate(fd, offset) != 0 || fdatasync(fd) != 0)) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+
+    Journal *journal = (Journal *) calloc(1, sizeof(Journal));
+    if (!journal)
+        fatal("out of memory");
+    journal->path = strdup(path);
+    journal->fd = fd;
+    if (pthread_mutex_init(&journal->lock, 0) != 0)
+        syserr("mutex init failed");
+    if (pthread_cond_init(&journal->round_done, 0) != 0)
+        syserr("cond init failed");
+    if (pthread_mutex_init(&journal->compact_lock, 0) != 0)
+        syserr("mutex init failed");
+    return journal;
+}
+
+/* Writes and syncs every change appended so far. Other processes may keep appending
+ * in the meantime. Must be called with the lock held and no round in progress. */
+static void write_round(Journal *journal) {
+    journal->writing = true;
+    char *data = journal->buffer;
+    size_t size = journal->size;
+    size_t data_capacity = journal->capacity;
+    uint64_t last = journal->appended;
+    journal->buffer = journal->spare;
+    journal->capacity = journal->spare_capacity;
+    journal->size = 0;
+    unlock(&journal->lock);
+
+    if (size > 0) {
+        int error = write_all(journal->fd, data, size);
+        if (error != 0) {
+            errno = error;
+            syserr("journal write failed");
+        }
+        if (fdatasync(journal->fd) != 0)
+            syserr("journal sync failed");
+    }
+
+    lock(&journal->lock);
+    journal->spare = data;
+    journal->spare_capacity = data_capacity;
+    journal->durable = last;
+    journal->writing = false;
+    if (pthread_cond_broadcast(&journal->round_done) != 0)
+        syserr("cond broadcast failed");
+}
+
+/* Waits until every change appended so far is durable. Must be called with the lock held. */
+static void wait_durable(Journal *journal, uint64_t ticket) {
+    while (journal->durable < ticket) {
+        if (journal->writing) {
+            if (pthread_cond_wait(&journal->round_done, &journal->lock) != 0)
+                syserr("cond wait failed");
+        }
+        else {
+            write_round(journal);
+        }
+    }
+}
+
+void journal_close(Journal *journal) {
+    lock(&journal->lock);
+    wait_durable(journal, journal->appended);
+    unlock(&journal->lock);
+
+    if (close(journal->fd) != 0)
+        syserr("close failed");
+    if (pthread_cond_destroy(&journal->round_done) != 0)
+        syserr("cond destroy failed");
+    if (pthread_mutex_destroy(&journal->lock) != 0)
+        syserr("mutex destroy failed");
+    if (pthread_mutex_destroy(&journal->compact_lock) != 0)
+        syserr("mutex destroy failed");
+    free(journal->buffer);
+    free(journal->spare);
+    free(journal->path);
+    free(journal);
+}
+
+uint64_t journal_append(Journal *journal, unsigned long time, JournalOp op, const char *path,
+                        const char *target) {
+    size_t path_size = strlen(path) + 1;
+    size_t target_size = target ? strlen(target) + 1 : 0;
+    EntryHeader header = { (uint32_t) (path_size + target_size), 0, time, op, 0 };
+
+    lock(&journal->lock);
+    size_t needed = journal->size + sizeof(header) + header.size;
+    if (needed > journal->capacity) {
+        size_t capacity = journal->capacity ? journal->capacity : 4096;
+        while (capacity < needed)
+            capacity *= 2;
+        journal->buffer = (char *) realloc(journal->buffer, capacity);
+        if (!journal->buffer)
+            fatal("out of memory");
+        journal->capacity = capacity;
+    }
+
+    char *paths = journal->buffer + journal->size + sizeof(header);
+    memcpy(paths, path, path_size);
+    if (target)
+        memcpy(paths + path_size, target, target_size);
+    header.checksum = entry_checksum(&header, paths);
+    memcpy(journal->buffer + journal->size, &header, sizeof(header));
+    journal->size = needed;
+    uint64_t ticket = ++journal->appended;
+    unlock(&journal->lock);
+
+    return ticket;
+}
+
+void journal_commit(Journal *journal, uint64_t ticket) {
+    lock(&journal->lock);
+    wait_durable(journal, ticket);
+    unlock(&journal->lock);
+}
+
+/* Writes the image to a new file next to `image_path` and puts it in its place once durable. */
+static int replace_image(const char *image_path, int (*save)(void *arg, int fd), void *arg) {
+    size_t length = strlen(image_path);
+    char *temporary = (char *) malloc(length + 5);
+    if (!temporary)
+        fatal("out of memory");
+    memcpy(temporary, image_path, length);
+    memcpy(temporary + length, ".tmp", 5);
+
+    int result = 0;
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        result = errno;
+    if (result == 0)
+        result = save(arg, fd);
+    if (result == 0 && fsync(fd) != 0)
+        result = errno;
+    if (fd >= 0 && close(fd) != 0 && result == 0)
+        result = errno;
+    if (result == 0 && rename(temporary, image_path) != 0)
+        result = errno;
+    if (result == 0)
+        result = sync_directory(image_path);
+    if (result != 0)
+        unlink(temporary);
+
+    free(temporary);
+    return result;
+}
+
+/* Waits until no round is in progress, so that the file holds only complete changes and nothing
+ * is written to it. Must be called with the lock held. */
+static void wait_idle(Journal *journal) {
+    while (journal->writing) {
+        if (pthread_cond_wait(&journal->round_done, &journal->lock) != 0)
+            syserr("cond wait failed");
+    }
+}
+
+/* Copies the changes in `size` bytes of the journal from `offset`, made at `time` or later,
+ * to `fd`. */
+static int copy_changes(Journal *journal, size_t offset, size_t size, unsigned long time, int fd) {
+    char *data = read_range(journal->fd, offset, size);
+    if (!data)
+        return errno;
+
+    int result = 0;
+    size_t begin = 0, end = 0;
+    JournalEntry entry;
+    while (read_entry(data, size, &end, &entry)) {
+        if (entry.time >= time && (result = write_all(fd, data + begin, end - begin)) != 0)
+            break;
+        begin = end;
+    }
+    free(data);
+    return result;
+}
+
+/* Sets `*size` to the size of the journal, which no round may be writing to.
+ * Returns 0 or an error code. */
+static int journal_size(Journal *journal, size_t *size) {
+    struct stat file;
+    if (fstat(journal->fd, &file) != 0)
+        return errno;
+    *size = file.st_size;
+    return 0;
+}
+
+int journal_compact(Journal *journal, const char *image_path, unsigned long time,
+                    int (*save)(void *arg, int fd), void *arg) {
+    lock(&journal->compact_lock);
+
+    /* A crash from now on leaves either the old image with the whole journal, or the new one
+     * with changes it already contains, which are skipped when replayed. */
+    int result = replace_image(image_path, save, arg);
+    if (result != 0) {
+        unlock(&journal->compact_lock);
+        return result;
+    }
+
+    size_t length = strlen(journal->path);
+    char *temporary = (char *) malloc(length + 5);
+    if (!temporary)
+        fatal("out of memory");
+    memcpy(temporary, journal->path, length);
+    memcpy(temporary + length, ".tmp", 5);
+    int fd = open(temporary, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        result = errno;
+        free(temporary);
+        unlock(&journal->compact_lock);
+        return result;
+    }
+
+    /* The changes written so far are copied while others keep appending. Only those written
+     * in the meantime are then copied with appends blocked. */
+    size_t copied = 0, size = 0;
+    lock(&journal->lock);
+    wait_idle(journal);
+    result = journal_size(journal, &copied);
+    unlock(&journal->lock);
+    if (result == 0)
+        result = copy_changes(journal, 0, copied, time, fd);
+    if (result == 0 && fdatasync(fd) != 0)
+        result = errno;
+
+    lock(&journal->lock);
+    if (result == 0) {
+        wait_idle(journal);
+        result = journal_size(journal, &size);
+    }
+    if (result == 0)
+        result = copy_changes(journal, copied, size - copied, time, fd);
+    if (result == 0 && fdatasync(fd) != 0)
+        result = errno;
+    if (result == 0 && rename(temporary, journal->path) != 0)
+        result = errno;
+
+    /* Once renamed, the new journal is the only one there is, even if renaming it
+     * can't be made durable. */
+    bool renamed = result == 0;
+    if (renamed) {
+        close(journal->fd);
+        journal->fd = fd;
+    }
+    unlock(&journal->lock);
+
+    if (renamed) {
+        result = sync_directory(journal->path);
+    }
+    else {
+        close(fd);
+        unlink(temporary);
+    }
+    unlock(&journal->compact_lock);
+
+    free(temporary);
+    return result;
+}
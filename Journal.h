@@ -0,0 +1,58 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+/* An append-only file of the changes made to a tree, replayed when the tree is reopened.
+ * Changes are appended to a buffer, which processes waiting for their changes to become
+ * durable write out and sync together, one process for everyone waiting at the time. */
+typedef struct Journal Journal;
+
+typedef enum JournalOp {
+    JOURNAL_CREATE = 1,
+    JOURNAL_REMOVE,
+    JOURNAL_REMOVE_RECURSIVE,
+    JOURNAL_MOVE,
+    JOURNAL_CREATE_ALL, /* A folder created together with its missing ancestors. */
+} JournalOp;
+
+/* A change read back from a journal. */
+typedef struct JournalEntry {
+    unsigned long time; /* Time of the change on the tree's clock. */
+    JournalOp op;
+    const char *path;
+    const char *target; /* Only for moves, NULL otherwise. */
+} JournalEntry;
+
+typedef void (*JournalReplay)(void *arg, const JournalEntry *entry);
+
+/* Opens or creates the journal at `path`, calling `replay(arg, entry)` for every change
+ * in it made after `after`, in the order of their times. An incomplete change at the end
+ * of the file, left by a crash, is dropped. Sets `*last` to the latest time in the journal,
+ * or to `after` if there's none.
+ * Returns NULL and sets errno if the file can't be opened or read. */
+Journal *journal_open(const char *path, unsigned long after, JournalReplay replay, void *arg,
+                      unsigned long *last);
+
+/* Makes every change appended so far durable and closes the journal. */
+void journal_close(Journal *journal);
+
+/* Appends a change made at `time`. Changes that depend on each other have to be appended
+ * in the order of their times. Returns a ticket to wait for with `journal_commit`. */
+uint64_t journal_append(Journal *journal, unsigned long time, JournalOp op, const char *path,
+                        const char *target);
+
+/* Waits until the change with `ticket`, and every change appended before it, is durable. */
+void journal_commit(Journal *journal, uint64_t ticket);
+
+/* Saves an image of the tree as it was at `time`, with `save(arg, fd)`, to the file at
+ * `image_path`, replacing it only once the image is durable. Then drops the changes made
+ * before `time` from the journal, blocking appends only while it copies those made during
+ * the compaction. Returns 0, or the error code of a failed save, read or write, leaving
+ * the journal unchanged. If the journal has been replaced but the replacement can't be made
+ * durable, its error code is returned and the new journal is kept, but a crash may bring back
+ * the old one without the changes appended since. */
+int journal_compact(Journal *journal, const char *image_path, unsigned long time,
+                    int (*save)(void *arg, int fd), void *arg);
+
+#endif //JOURNAL_H
@@ -1,29 +1,466 @@
+#include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include "Node.h"
+#include "epoch.h"
+#include "path_utils.h"
 #include "err.h"
 
+/* Bounds of the number of times a process checks a busy node before it blocks. */
+#define MIN_SPINS 16
+#define MAX_SPINS 2048
+
+static TreeLockPolicy lock_policy = TREE_LOCK_HANDOFF;
+
+/* Whether processes spin before they block, -1 until it's been decided. */
+static atomic_int spin_enabled = -1;
+
+/* How many times the calling thread checks a busy node before it blocks. Doubled whenever
+ * the node becomes free while the thread spins and halved whenever it doesn't, so that threads
+ * stop spinning on nodes that are held for long. */
+static __thread unsigned spin_budget = 8 * MIN_SPINS;
+
+void node_set_lock_policy(TreeLockPolicy policy, bool spin) {
+    lock_policy = policy;
+    /* A node can't be released by another process while this one is spinning on the only CPU. */
+    atomic_store(&spin_enabled, spin && sysconf(_SC_NPROCESSORS_ONLN) > 1);
+}
+
+static bool should_spin() {
+    int enabled = atomic_load_explicit(&spin_enabled, memory_order_relaxed);
+    if (enabled < 0) {
+        enabled = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+        atomic_store_explicit(&spin_enabled, enabled, memory_order_relaxed);
+    }
+    return enabled;
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* Checks, without synchronization, whether a process that wants read or write access
+ * to `node` might get it without blocking. */
+static bool looks_free(Node *node, bool write);
+
+/* Spins while `node` looks busy, at most for the budget of the calling thread. */
+static void spin_while_busy(Node *node, bool write) {
+    if (!should_spin())
+        return;
+
+    for (unsigned i = 0; i < spin_budget; i++) {
+        if (looks_free(node, write)) {
+            if (i > 0 && spin_budget < MAX_SPINS)
+                spin_budget *= 2;
+            return;
+        }
+        cpu_relax();
+    }
+    if (spin_budget > MIN_SPINS)
+        spin_budget /= 2;
+}
+
+static void init_reader_bias(Node *node) {
+    atomic_init(&node->reader_bias, false);
+    atomic_init(&node->locked_reads, 0);
+    atomic_init(&node->bias_inhibited_until, 0);
+}
+
+/* States of a published request. */
+#define REQUEST_PENDING 0u
+#define REQUEST_SLEEPING 1u /* Pending, and its process may be blocked waiting for it. */
+#define REQUEST_APPLIED 2u
+
+static void init_requests(Node *node) {
+    atomic_init(&node->requests, NULL);
+    atomic_init(&node->combining, false);
+}
+
+/* Blocks until `request` has been applied, or until no process may be applying the requests
+ * published for `node`, or spuriously. */
+static void wait_for_combiner(Node *node, NodeRequest *request);
+
+/* Wakes up the processes blocked in `wait_for_combiner`. */
+static void wake_requesters(Node *node);
+
+#ifdef NODE_FUTEX_LOCK
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/* Layout of the lock word:
+ * - bits 0-9: number of readers that have access,
+ * - bit 10: a writer has access,
+ * - bit 11: read phase - a writer has just handed the node over to the waiting readers,
+ *   which may enter even though writers are waiting, until all of them have entered,
+ * - bit 12: a process in `get_move_access` is waiting for the node to become idle,
+ * - bits 13-22: number of waiting readers,
+ * - bits 23-31: number of waiting writers.
+ * Like the condition-variable version, readers that arrive while a writer is waiting queue up
+ * behind it, and a leaving writer lets all waiting readers in before the next writer, unless
+ * the policy is TREE_LOCK_WRITERS_FIRST. Under TREE_LOCK_PHASE_FAIR, readers that weren't waiting
+ * when the writer left don't register as waiting until the read phase is over, so that they
+ * can't prolong it. */
+#define READER 1u
+#define READERS_MASK 0x3ffu
+#define WRITER (1u << 10)
+#define READ_PHASE (1u << 11)
+#define MOVE_WAITING (1u << 12)
+#define READERS_WAITING_SHIFT 13
+#define READER_WAITING (1u << READERS_WAITING_SHIFT)
+#define READERS_WAITING_MASK (0x3ffu << READERS_WAITING_SHIFT)
+#define WRITERS_WAITING_SHIFT 23
+#define WRITER_WAITING (1u << WRITERS_WAITING_SHIFT)
+#define WRITERS_WAITING_MASK (0x1ffu << WRITERS_WAITING_SHIFT)
+
+#define readers(state) ((state) & READERS_MASK)
+#define readers_waiting(state) (((state) & READERS_WAITING_MASK) >> READERS_WAITING_SHIFT)
+#define writers_waiting(state) (((state) & WRITERS_WAITING_MASK) >> WRITERS_WAITING_SHIFT)
+
+static void futex_wait(atomic_uint *word, unsigned value) {
+    if (syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0) != 0
+        && errno != EAGAIN && errno != EINTR)
+        syserr("futex wait failed");
+}
+
+static void futex_wake_all(atomic_uint *word) {
+    if (syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0) < 0)
+        syserr("futex wake failed");
+}
+
+/* Checks whether a counter of the lock word is full, so that adding to it would overflow into
+ * the next field. A process that can't be counted yields and tries again instead, without
+ * registering as waiting, which only happens with hundreds of processes at a single node. */
+static bool is_full(unsigned state, unsigned mask) {
+    return (state & mask) == mask;
+}
+
+/* Checks whether a reader may get access to the node in `state`. `waiting` tells whether it has
+ * registered as waiting. */
+static bool reader_may_enter(unsigned state, bool waiting) {
+    if (state & WRITER)
+        return false;
+    if (writers_waiting(state) == 0)
+        return true;
+    /* Readers queue up behind waiting writers unless the node has been handed over to them. */
+    switch (lock_policy) {
+        case TREE_LOCK_PHASE_FAIR:
+            return (state & READ_PHASE) && waiting;
+        case TREE_LOCK_WRITERS_FIRST:
+            return false;
+        default:
+            return state & READ_PHASE;
+    }
+}
+
+static bool writer_may_enter(unsigned state) {
+    return readers(state) == 0 && !(state & (WRITER | READ_PHASE));
+}
+
+static bool looks_free(Node *node, bool write) {
+    unsigned state = atomic_load_explicit(&node->lock, memory_order_relaxed);
+    return write ? writer_may_enter(state) : reader_may_enter(state, false);
+}
+
+void init_node_sync(Node *node) {
+    atomic_init(&node->lock, 0);
+    atomic_init(&node->requests_round, 0);
+    init_reader_bias(node);
+    init_requests(node);
+}
+
+void destroy_node_sync(Node *node) {
+    (void) node;
+}
+
+static void acquire_read(Node *node) {
+    if (!node)
+        return;
+
+    unsigned state = atomic_load(&node->lock);
+    bool waiting = false;
+    bool spun = false;
+
+    for (;;) {
+        bool may_enter = reader_may_enter(state, waiting);
+        unsigned new_state;
+
+        if (may_enter && is_full(state, READERS_MASK)) {
+            sched_yield();
+            state = atomic_load(&node->lock);
+            continue;
+        }
+        else if (may_enter) {
+            new_state = state + READER;
+            if (waiting) {
+                new_state -= READER_WAITING;
+                if (readers_waiting(new_state) == 0)
+                    new_state &= ~READ_PHASE;
+            }
+        }
+        else if (!waiting && !spun) {
+            /* A short wait is spun out before the process makes the releaser wake it. */
+            spun = true;
+            spin_while_busy(node, false);
+            state = atomic_load(&node->lock);
+            continue;
+        }
+        else if (!waiting && is_full(state, READERS_WAITING_MASK)) {
+            sched_yield();
+            state = atomic_load(&node->lock);
+            continue;
+        }
+        else if (!waiting && !(lock_policy == TREE_LOCK_PHASE_FAIR && (state & READ_PHASE))) {
+            new_state = state + READER_WAITING;
+        }
+        else {
+            /* A reader that has missed a read phase isn't registered, and is woken
+             * by the last reader of the phase letting the writers in. */
+            futex_wait(&node->lock, state);
+            state = atomic_load(&node->lock);
+            continue;
+        }
+
+        if (atomic_compare_exchange_weak(&node->lock, &state, new_state)) {
+            if (may_enter)
+                return;
+            waiting = true;
+            state = new_state;
+        }
+    }
+}
+
+static void release_read(Node *node) {
+    unsigned state = atomic_load(&node->lock);
+    unsigned new_state;
+
+    do {
+        new_state = state - READER;
+        /* The last reader lets a waiting writer in, or tells a waiting mover the node is idle. */
+        if (readers(new_state) == 0 && writers_waiting(new_state) == 0)
+            new_state &= ~MOVE_WAITING;
+    } while (!atomic_compare_exchange_weak(&node->lock, &state, new_state));
+
+    if (readers(new_state) == 0 && (writers_waiting(new_state) > 0 || (state & MOVE_WAITING)))
+        futex_wake_all(&node->lock);
+}
+
+static void acquire_write(Node *node) {
+    if (!node)
+        return;
+
+    unsigned state = atomic_load(&node->lock);
+    bool waiting = false;
+    bool spun = false;
+
+    for (;;) {
+        bool may_enter = writer_may_enter(state);
+        unsigned new_state;
+
+        if (may_enter)
+            new_state = (waiting ? state - WRITER_WAITING : state) | WRITER;
+        else if (!waiting && !spun) {
+            spun = true;
+            spin_while_busy(node, true);
+            state = atomic_load(&node->lock);
+            continue;
+        }
+        else if (!waiting && is_full(state, WRITERS_WAITING_MASK)) {
+            sched_yield();
+            state = atomic_load(&node->lock);
+            continue;
+        }
+        else if (!waiting)
+            new_state = state + WRITER_WAITING;
+        else {
+            futex_wait(&node->lock, state);
+            state = atomic_load(&node->lock);
+            continue;
+        }
+
+        if (atomic_compare_exchange_weak(&node->lock, &state, new_state)) {
+            if (may_enter)
+                break;
+            waiting = true;
+            state = new_state;
+        }
+    }
+
+    atomic_fetch_add(&node->version, 1);
+}
+
+static bool try_acquire_write(Node *node) {
+    unsigned state = atomic_load(&node->lock);
+
+    /* Like `acquire_write`, but doesn't overtake waiting processes either. */
+    while (state == (state & MOVE_WAITING)) {
+        if (atomic_compare_exchange_weak(&node->lock, &state, state | WRITER)) {
+            atomic_fetch_add(&node->version, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void release_write(Node *node) {
+    atomic_fetch_add(&node->version, 1);
+
+    unsigned state = atomic_load(&node->lock);
+    unsigned new_state;
+
+    do {
+        new_state = state & ~WRITER;
+        /* Waiting readers go first, then waiting writers, unless writers always go first. */
+        if (readers_waiting(state) > 0) {
+            if (lock_policy != TREE_LOCK_WRITERS_FIRST)
+                new_state |= READ_PHASE;
+        }
+        else if (writers_waiting(state) == 0)
+            new_state &= ~MOVE_WAITING;
+    } while (!atomic_compare_exchange_weak(&node->lock, &state, new_state));
+
+    if (state & (READERS_WAITING_MASK | WRITERS_WAITING_MASK | MOVE_WAITING))
+        futex_wake_all(&node->lock);
+}
+
+static void wait_until_idle(Node *node) {
+    unsigned state = atomic_load(&node->lock);
+
+    while ((state & ~MOVE_WAITING) != 0) {
+        if (!(state & MOVE_WAITING)
+            && !atomic_compare_exchange_weak(&node->lock, &state, state | MOVE_WAITING))
+            continue;
+        futex_wait(&node->lock, state | MOVE_WAITING);
+        state = atomic_load(&node->lock);
+    }
+    if (state == MOVE_WAITING)
+        atomic_compare_exchange_strong(&node->lock, &state, 0);
+}
+
+static void wait_for_combiner(Node *node, NodeRequest *request) {
+    /* A process that wakes the requesters changes the round after it has applied their requests
+     * or stopped applying them. */
+    unsigned round = atomic_load(&node->requests_round);
+    unsigned state = REQUEST_PENDING;
+    if (!atomic_compare_exchange_strong(&request->state, &state, REQUEST_SLEEPING)
+        && state == REQUEST_APPLIED)
+        return;
+    if (atomic_load(&node->combining))
+        futex_wait(&node->requests_round, round);
+}
+
+static void wake_requesters(Node *node) {
+    atomic_fetch_add(&node->requests_round, 1);
+    futex_wake_all(&node->requests_round);
+}
+
+#else
+
 #define WRITE_ACCESS -1
 
-void get_read_access(Node *node) {
+/* Checks whether a reader that started waiting in read phase `phase` may access the node. */
+static bool may_read(Node *node, unsigned long phase) {
+    if (node->writers_count + node->writers_waiting == 0)
+        return true;
+    switch (lock_policy) {
+        case TREE_LOCK_PHASE_FAIR:
+            /* Only the readers that were waiting when the writer left. */
+            return node->change > 0 && node->read_phase != phase;
+        case TREE_LOCK_WRITERS_FIRST:
+            return false;
+        default:
+            return node->change > 0;
+    }
+}
+
+static bool may_write(Node *node) {
+    if (node->change == WRITE_ACCESS)
+        return true;
+    /* Under TREE_LOCK_PHASE_FAIR, readers let in by a leaving writer go first. */
+    return node->writers_count + node->readers_count == 0
+           && (lock_policy != TREE_LOCK_PHASE_FAIR || node->change <= 0);
+}
+
+/* Only a writer can be seen without locking the node. */
+static bool looks_free(Node *node, bool write) {
+    (void) write;
+    return !(atomic_load_explicit(&node->version, memory_order_relaxed) & 1);
+}
+
+void init_node_sync(Node *node) {
+    if (pthread_mutex_init(&node->mutex, 0) != 0)
+        syserr("mutex init failed");
+    if (pthread_cond_init(&node->read_cond, 0) != 0)
+        syserr("read cond init failed");
+    if (pthread_cond_init(&node->write_cond, 0) != 0)
+        syserr("modify cond init failed");
+    if (pthread_cond_init(&node->move_cond, 0) != 0)
+        syserr("move cond init failed");
+    if (pthread_cond_init(&node->request_cond, 0) != 0)
+        syserr("request cond init failed");
+
+    node->change = 0;
+    node->writers_waiting = 0;
+    node->readers_waiting = 0;
+    node->writers_count = 0;
+    node->readers_count = 0;
+    node->read_phase = 0;
+    init_reader_bias(node);
+    init_requests(node);
+}
+
+void destroy_node_sync(Node *node) {
+    if (pthread_mutex_destroy(&node->mutex) != 0)
+        syserr("mutex destroy failed");
+    if (pthread_cond_destroy(&node->read_cond) != 0)
+        syserr("read cond destroy failed");
+    if (pthread_cond_destroy(&node->write_cond) != 0)
+        syserr("modify cond destroy failed");
+    if (pthread_cond_destroy(&node->move_cond) != 0)
+        syserr("move cond destroy failed");
+    if (pthread_cond_destroy(&node->request_cond) != 0)
+        syserr("request cond destroy failed");
+}
+
+static void acquire_read(Node *node) {
     if (!node)
         return;
 
+    /* A short write is spun out before the process blocks on the mutex. */
+    spin_while_busy(node, false);
+
     if (pthread_mutex_lock(&node->mutex) != 0)
         syserr("lock failed");
 
     node->readers_waiting++;
+    unsigned long phase = node->read_phase;
 
-    while (node->writers_count + node->writers_waiting > 0 && node->change <= 0) {
+    while (!may_read(node, phase)) {
         if (pthread_cond_wait(&node->read_cond, &node->mutex) != 0)
             syserr("read cond wait failed");
     }
     node->readers_waiting--;
 
-    if (node->change > 0)
+    /* A reader let in by the leaving writer takes one of the places it has made. */
+    bool signaled = node->change > 0
+                    && (lock_policy != TREE_LOCK_PHASE_FAIR || node->read_phase != phase);
+    if (signaled)
         node->change--;
 
     node->readers_count++;
 
-    if (node->change > 0)
+    /* Under TREE_LOCK_PHASE_FAIR, all the readers have been woken at once. */
+    if (node->change > 0 && lock_policy != TREE_LOCK_PHASE_FAIR)
         if (pthread_cond_signal(&node->read_cond) != 0)
             syserr("read cond signal failed");
 
@@ -32,13 +469,16 @@ void get_read_access(Node *node) {
 }
 
 
-void give_up_read_access(Node *node) {
+static void release_read(Node *node) {
     if (pthread_mutex_lock(&node->mutex) != 0)
         syserr("mutex lock failed");
 
     node->readers_count--;
 
-    if (node->readers_count == 0 && node->writers_waiting > 0) {
+    /* Under TREE_LOCK_PHASE_FAIR, the last of the readers let in by a writer lets the next one in. */
+    bool readers_pending = lock_policy == TREE_LOCK_PHASE_FAIR && node->change > 0;
+
+    if (node->readers_count == 0 && node->writers_waiting > 0 && !readers_pending) {
         node->change = WRITE_ACCESS;
         if (pthread_cond_signal(&node->write_cond) != 0)
             syserr("modify cond wait failed");
@@ -53,15 +493,17 @@ void give_up_read_access(Node *node) {
 }
 
 
-void get_write_access(Node *node) {
+static void acquire_write(Node *node) {
     if (!node)
         return;
 
+    spin_while_busy(node, true);
+
     if (pthread_mutex_lock(&node->mutex) != 0)
         syserr("lock failed");
 
     node->writers_waiting++;
-    while (node->writers_count + node->readers_count > 0 && node->change != WRITE_ACCESS) {
+    while (!may_write(node)) {
         if (pthread_cond_wait(&node->write_cond, &node->mutex) != 0)
             syserr("modify cond wait failed");
     }
@@ -69,18 +511,44 @@ void get_write_access(Node *node) {
 
     node->change = 0;
     node->writers_count++;
+    atomic_fetch_add(&node->version, 1);
 
     if (pthread_mutex_unlock(&node->mutex) != 0)
         syserr("unlock failed");
 }
 
-void give_up_write_access(Node *node) {
+static bool try_acquire_write(Node *node) {
     if (pthread_mutex_lock(&node->mutex) != 0)
         syserr("lock failed");
 
+    /* Like `acquire_write`, but doesn't overtake waiting or signaled processes either. */
+    bool idle = node->writers_count + node->readers_count + node->writers_waiting
+                + node->readers_waiting == 0 && node->change == 0;
+    if (idle) {
+        node->writers_count++;
+        atomic_fetch_add(&node->version, 1);
+    }
+
+    if (pthread_mutex_unlock(&node->mutex) != 0)
+        syserr("unlock failed");
+    return idle;
+}
+
+static void release_write(Node *node) {
+    if (pthread_mutex_lock(&node->mutex) != 0)
+        syserr("lock failed");
+
+    atomic_fetch_add(&node->version, 1);
     node->writers_count--;
 
-    if (node->readers_waiting > 0) {
+    /* Waiting readers go first, then waiting writers, unless writers always go first. */
+    if (node->readers_waiting > 0 && lock_policy == TREE_LOCK_PHASE_FAIR) {
+        node->change = node->readers_waiting;
+        node->read_phase++;
+        if (pthread_cond_broadcast(&node->read_cond) != 0)
+            syserr("read cond broadcast failed");
+    }
+    else if (node->readers_waiting > 0 && lock_policy == TREE_LOCK_HANDOFF) {
         node->change = node->readers_waiting;
         if (pthread_cond_signal(&node->read_cond) != 0)
             syserr("read cond signal failed");
@@ -90,6 +558,10 @@ void give_up_write_access(Node *node) {
         if (pthread_cond_signal(&node->write_cond) != 0)
             syserr("write cond signal failed");
     }
+    else if (node->readers_waiting > 0) {
+        if (pthread_cond_broadcast(&node->read_cond) != 0)
+            syserr("read cond broadcast failed");
+    }
     else {
         if (pthread_cond_signal(&node->move_cond) != 0)
             syserr("move cond wait failed");
@@ -100,7 +572,7 @@ void give_up_write_access(Node *node) {
 }
 
 
-void get_move_access(Node *node) {
+static void wait_until_idle(Node *node) {
     if (pthread_mutex_lock(&node->mutex) != 0)
         syserr("lock failed");
 
@@ -113,4 +585,432 @@ void get_move_access(Node *node) {
 
     if (pthread_mutex_unlock(&node->mutex) != 0)
         syserr("unlock failed");
-}
\ No newline at end of file
+}
+
+static void wait_for_combiner(Node *node, NodeRequest *request) {
+    if (pthread_mutex_lock(&node->mutex) != 0)
+        syserr("lock failed");
+
+    unsigned state = REQUEST_PENDING;
+    atomic_compare_exchange_strong(&request->state, &state, REQUEST_SLEEPING);
+    while (atomic_load(&request->state) != REQUEST_APPLIED && atomic_load(&node->combining)) {
+        if (pthread_cond_wait(&node->request_cond, &node->mutex) != 0)
+            syserr("request cond wait failed");
+    }
+
+    if (pthread_mutex_unlock(&node->mutex) != 0)
+        syserr("unlock failed");
+}
+
+static void wake_requesters(Node *node) {
+    if (pthread_mutex_lock(&node->mutex) != 0)
+        syserr("lock failed");
+    if (pthread_cond_broadcast(&node->request_cond) != 0)
+        syserr("request cond broadcast failed");
+    if (pthread_mutex_unlock(&node->mutex) != 0)
+        syserr("unlock failed");
+}
+
+#endif //NODE_FUTEX_LOCK
+
+/* Every thread publishes the nodes it holds or waits for access to, so that `subtree_wait`
+ * can tell whether a subtree is idle by checking the published nodes instead of visiting
+ * the whole subtree.
+ *
+ * The publications also serve as reader indicators for nodes with `reader_bias` set:
+ * a reader of such a node only publishes it, tagged with BIASED_READ, and checks that the bias
+ * is still set, so that it touches only its own holder and not the node's lock. A writer clears
+ * the bias after it has acquired the lock, and waits until no holder has the node tagged,
+ * blocking until readers leaving it wake it if that takes long.
+ * As revoking takes time proportional to the number of threads, the bias isn't enabled again
+ * for a while, and only once readers have locked the node BIAS_READS times without a write. */
+
+/* Slots for the nodes a single thread holds or waits for, filling its holder's cache line. */
+#define MAX_HELD 8
+static_assert(MAX_HELD >= MAX_NODES_HELD, "holders must fit all nodes a process may hold");
+
+/* A chain of parents longer than that can only be seen while nodes are being moved. */
+#define MAX_DEPTH (MAX_PATH_DEPTH + 1)
+
+/* How many times a thread waiting for holders to leave yields before it blocks. */
+#define WAIT_YIELDS 64
+
+/* Tags a published node that its reader holds without locking it. Nodes are aligned. */
+#define BIASED_READ ((uintptr_t) 1)
+
+/* Number of locked reads without a write after which the reader bias is enabled. */
+#define BIAS_READS 256
+
+/* After a revocation, the bias isn't enabled again for that many times as long as it took. */
+#define BIAS_INHIBIT_FACTOR 9
+
+typedef struct Holder Holder;
+
+/* Aligned, so that readers holding nodes without locking them touch only their own cache line. */
+struct Holder {
+    _Alignas(64) _Atomic(Node *) held[MAX_HELD];
+    int count; /* Used only by the owner. */
+
+    atomic_bool in_use;
+    Holder *next;
+};
+
+static _Atomic(Holder *) holders = NULL;
+
+/* Threads blocked until holders leave register in `departure_waiters`, so that threads dropping
+ * their nodes wake them only while someone waits. The waiters check again whether they still
+ * have to wait, so a single condition serves all of them. */
+static pthread_mutex_t departure_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t departure_cond = PTHREAD_COND_INITIALIZER;
+static atomic_uint departure_waiters = 0;
+
+static Node *tag_biased(Node *node) {
+    return (Node *) ((uintptr_t) node | BIASED_READ);
+}
+
+static Node *untag(Node *node) {
+    return (Node *) ((uintptr_t) node & ~BIASED_READ);
+}
+
+static pthread_once_t holder_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t holder_key;
+static __thread Holder *local_holder;
+
+/* Lets a new thread reuse the holder of an exited one. It holds no nodes anymore. */
+static void release_holder(void *arg) {
+    atomic_store(&((Holder *) arg)->in_use, false);
+}
+
+static void make_holder_key() {
+    if (pthread_key_create(&holder_key, release_holder) != 0)
+        syserr("key create failed");
+}
+
+static Holder *get_holder() {
+    if (local_holder)
+        return local_holder;
+
+    if (pthread_once(&holder_key_once, make_holder_key) != 0)
+        syserr("once failed");
+
+    Holder *holder = NULL;
+    for (Holder *h = atomic_load(&holders); h && !holder; h = h->next) {
+        bool expected = false;
+        if (!atomic_load(&h->in_use) && atomic_compare_exchange_strong(&h->in_use, &expected, true))
+            holder = h;
+    }
+
+    if (!holder) {
+        holder = (Holder *) aligned_alloc(_Alignof(Holder), sizeof(Holder));
+        if (!holder)
+            fatal("out of memory");
+        memset(holder, 0, sizeof(Holder));
+        atomic_init(&holder->in_use, true);
+        Holder *head = atomic_load(&holders);
+        do {
+            holder->next = head;
+        } while (!atomic_compare_exchange_weak(&holders, &head, holder));
+    }
+
+    if (pthread_setspecific(holder_key, holder) != 0)
+        syserr("setspecific failed");
+    local_holder = holder;
+    return local_holder;
+}
+
+/* Publishes that the calling thread is about to wait for access to `node`.
+ * The publication is ordered before anything the thread does afterwards, such as checking
+ * whether a move has begun after acquiring access. */
+static void hold_node(Node *node) {
+    Holder *holder = get_holder();
+    assert(holder->count < MAX_NODES_HELD);
+    atomic_store(&holder->held[holder->count++], node);
+}
+
+static void wake_departure_waiters() {
+    if (pthread_mutex_lock(&departure_lock) != 0)
+        syserr("lock failed");
+    if (pthread_cond_broadcast(&departure_cond) != 0)
+        syserr("departure cond broadcast failed");
+    if (pthread_mutex_unlock(&departure_lock) != 0)
+        syserr("unlock failed");
+}
+
+/* Waits until `must_wait(node)` is false, which may only change when a holder leaves,
+ * or stops holding a node without locking it. */
+static void wait_for_departures(bool (*must_wait)(Node *), Node *node) {
+    for (int attempt = 0; attempt < WAIT_YIELDS; attempt++) {
+        if (!must_wait(node))
+            return;
+        sched_yield();
+    }
+
+    if (pthread_mutex_lock(&departure_lock) != 0)
+        syserr("lock failed");
+    /* A holder leaving after the check below sees the registration, and can't wake the waiters
+     * before this thread waits, as it needs the mutex for that. */
+    atomic_fetch_add(&departure_waiters, 1);
+    while (must_wait(node)) {
+        if (pthread_cond_wait(&departure_cond, &departure_lock) != 0)
+            syserr("departure cond wait failed");
+    }
+    atomic_fetch_sub(&departure_waiters, 1);
+    if (pthread_mutex_unlock(&departure_lock) != 0)
+        syserr("unlock failed");
+}
+
+/* Withdraws the publication of `node` by the calling thread, waking threads waiting for it. */
+static void drop_node(Node *node) {
+    Holder *holder = local_holder;
+    int last = holder->count - 1;
+    for (int i = last; i >= 0; i--) {
+        if (untag(atomic_load_explicit(&holder->held[i], memory_order_relaxed)) == node) {
+            /* The last node is copied first, so that it stays visible all the time. */
+            if (i != last)
+                atomic_store(&holder->held[i], atomic_load_explicit(&holder->held[last], memory_order_relaxed));
+            /* Pairs with a waiter registering before it checks the holders. */
+            atomic_store(&holder->held[last], NULL);
+            holder->count--;
+            if (atomic_load(&departure_waiters))
+                wake_departure_waiters();
+            return;
+        }
+    }
+}
+
+/* Checks whether the publication of `node` that `drop_node` would withdraw is tagged. */
+static bool is_held_biased(Node *node) {
+    Holder *holder = local_holder;
+    for (int i = holder->count - 1; i >= 0; i--) {
+        Node *held = atomic_load_explicit(&holder->held[i], memory_order_relaxed);
+        if (untag(held) == node)
+            return held != node;
+    }
+    return false;
+}
+
+static unsigned long now_ns() {
+    struct timespec now;
+    if (clock_gettime(CLOCK_MONOTONIC, &now) != 0)
+        syserr("clock_gettime failed");
+    return (unsigned long) now.tv_sec * 1000000000ul + (unsigned long) now.tv_nsec;
+}
+
+/* Tries to get read access to the node published last by the calling thread without locking it. */
+static bool try_biased_read(Node *node) {
+    if (!atomic_load_explicit(&node->reader_bias, memory_order_relaxed))
+        return false;
+
+    /* Pairs with the writer clearing the bias before it checks the holders. */
+    Holder *holder = local_holder;
+    _Atomic(Node *) *held = &holder->held[holder->count - 1];
+    atomic_store(held, tag_biased(node));
+    if (atomic_load(&node->reader_bias))
+        return true;
+    atomic_store(held, node);
+    if (atomic_load(&departure_waiters))
+        wake_departure_waiters();
+    return false;
+}
+
+/* Counts a locked read of `node`, enabling the reader bias if the node is heavily read.
+ * The caller must have read access to `node`, so that no writer misses the bias. */
+static void count_locked_read(Node *node) {
+    unsigned reads = atomic_fetch_add_explicit(&node->locked_reads, 1, memory_order_relaxed) + 1;
+    if (reads % BIAS_READS == 0 && !atomic_load_explicit(&node->reader_bias, memory_order_relaxed)
+        && !atomic_load_explicit(&node->detaching, memory_order_relaxed) && now_ns() >= atomic_load_explicit(&node->bias_inhibited_until, memory_order_relaxed))
+        atomic_store(&node->reader_bias, true);
+}
+
+/* Checks whether any thread holds `node` without having locked it. */
+static bool has_biased_readers(Node *node) {
+    Node *tagged = tag_biased(node);
+    for (Holder *h = atomic_load(&holders); h; h = h->next) {
+        for (int i = 0; i < MAX_HELD; i++) {
+            if (atomic_load(&h->held[i]) == tagged)
+                return true;
+        }
+    }
+    return false;
+}
+
+/* Makes readers of `node` lock it again, and waits for those that haven't to leave.
+ * The caller must have write access to `node`, or otherwise keep new readers from locking it. */
+static void revoke_reader_bias(Node *node) {
+    unsigned long start = now_ns();
+    atomic_store(&node->reader_bias, false);
+    wait_for_departures(has_biased_readers, node);
+    unsigned long end = now_ns();
+    atomic_store_explicit(&node->bias_inhibited_until, end + BIAS_INHIBIT_FACTOR * (end - start),
+                          memory_order_relaxed);
+}
+
+void prefer_readers(Node *node) {
+    atomic_store(&node->reader_bias, true);
+}
+
+void get_read_access(Node *node) {
+    if (!node)
+        return;
+    hold_node(node);
+    if (try_biased_read(node))
+        return;
+    acquire_read(node);
+    count_locked_read(node);
+}
+
+void give_up_read_access(Node *node) {
+    if (!node)
+        return;
+    if (!is_held_biased(node))
+        release_read(node);
+    drop_node(node);
+}
+
+/* Finishes acquiring write access to `node`, once no other writer or locked reader has access. */
+static void revoke_readers(Node *node) {
+    if (atomic_load(&node->reader_bias))
+        revoke_reader_bias(node);
+    atomic_store_explicit(&node->locked_reads, 0, memory_order_relaxed);
+}
+
+void get_write_access(Node *node) {
+    if (!node)
+        return;
+    hold_node(node);
+    acquire_write(node);
+    revoke_readers(node);
+}
+
+bool try_get_write_access(Node *node) {
+    hold_node(node);
+    if (try_acquire_write(node)) {
+        /* Readers that hold the node without locking it aren't waited for either. */
+        if (atomic_load(&node->reader_bias)) {
+            atomic_store(&node->reader_bias, false);
+            if (has_biased_readers(node)) {
+                release_write(node);
+                drop_node(node);
+                return false;
+            }
+        }
+        atomic_store_explicit(&node->locked_reads, 0, memory_order_relaxed);
+        return true;
+    }
+    drop_node(node);
+    return false;
+}
+
+void get_move_access(Node *node) {
+    /* The bias is revoked with write access, like writers revoke it, as a writer that finds it
+     * already cleared doesn't wait for the biased readers. Readers that have locked the node
+     * in the meantime may have enabled it again. */
+    do {
+        if (atomic_load(&node->reader_bias)) {
+            get_write_access(node);
+            give_up_write_access(node);
+        }
+        wait_until_idle(node);
+    } while (atomic_load(&node->reader_bias));
+}
+
+void give_up_write_access(Node *node) {
+    if (!node)
+        return;
+    release_write(node);
+    drop_node(node);
+}
+
+/* Requests are published on a stack in the node. A process that has write access to the node sets
+ * `combining` while it applies them, and processes that see it set wait for their requests instead
+ * of for the lock, so that a single process applies the changes of many in one critical section.
+ * A process that publishes a request checks `combining` afterwards, and one that stops combining
+ * checks for published requests after clearing it, so that either the publisher acquires write
+ * access itself or its request is taken care of. */
+
+bool publish_request(Node *node, NodeRequest *request) {
+    atomic_store_explicit(&request->state, REQUEST_PENDING, memory_order_relaxed);
+    NodeRequest *head = atomic_load(&node->requests);
+    do
+        request->next = head;
+    while (!atomic_compare_exchange_weak(&node->requests, &head, request));
+
+    for (unsigned spins = 0;; spins++) {
+        if (atomic_load(&request->state) == REQUEST_APPLIED)
+            return false;
+        if (!atomic_load(&node->combining)) {
+            get_write_access(node);
+            atomic_store(&node->combining, true);
+            return true;
+        }
+        if (spins < spin_budget && should_spin())
+            cpu_relax();
+        else
+            wait_for_combiner(node, request);
+    }
+}
+
+NodeRequest *take_requests(Node *node) {
+    NodeRequest *request = atomic_exchange(&node->requests, NULL);
+    NodeRequest *oldest = NULL;
+
+    while (request) {
+        NodeRequest *next = request->next;
+        request->next = oldest;
+        oldest = request;
+        request = next;
+    }
+    return oldest;
+}
+
+void complete_requests(Node *node, NodeRequest *requests) {
+    bool sleeping = false;
+    while (requests) {
+        /* The request may be gone as soon as it's marked as applied. */
+        NodeRequest *next = requests->next;
+        if (atomic_exchange(&requests->state, REQUEST_APPLIED) == REQUEST_SLEEPING)
+            sleeping = true;
+        requests = next;
+    }
+    if (sleeping)
+        wake_requesters(node);
+}
+
+void stop_combining(Node *node) {
+    atomic_store(&node->combining, false);
+    if (atomic_load(&node->requests))
+        wake_requesters(node);
+}
+
+/* Checks whether `node` is `root` or lies below it. */
+static bool is_in_subtree(Node *node, Node *root) {
+    for (int depth = 0; node; depth++) {
+        /* Parents of nodes outside of `root`'s subtree may be changing, so a chain that's too long
+         * to be real is treated as if it led to `root`, to be checked again. */
+        if (node == root || depth > MAX_DEPTH)
+            return true;
+        node = atomic_load(&node->parent);
+    }
+    return false;
+}
+
+/* Checks whether any thread holds or waits for a node in the subtree rooted in `root`. */
+static bool is_subtree_busy(Node *root) {
+    bool busy = false;
+
+    /* Published nodes may belong to other trees, which mustn't be freed while they're checked. */
+    epoch_enter();
+    for (Holder *h = atomic_load(&holders); h && !busy; h = h->next) {
+        for (int i = 0; i < MAX_HELD && !busy; i++) {
+            Node *node = untag(atomic_load(&h->held[i]));
+            busy = node && is_in_subtree(node, root);
+        }
+    }
+    epoch_exit();
+
+    return busy;
+}
+
+void subtree_wait(Node *root) {
+    wait_for_departures(is_subtree_busy, root);
+}
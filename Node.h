@@ -2,13 +2,41 @@
 #define NODE_H
 
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include "HashMap.h"
+#include "ChildIndex.h"
+#include "TreeImage.h"
+#include "Tree.h"
 
 typedef struct Node Node;
 
+/* A change of the children of a node, see History.h. */
+typedef struct ChildEvent ChildEvent;
+
+/* A change of a node published by a process that has found it busy, for the process that has
+ * write access to it to apply. See `publish_request`. */
+typedef struct NodeRequest NodeRequest;
+
+struct NodeRequest {
+    NodeRequest *next;
+    atomic_uint state; /* Whether the request has been applied, see Node.c. */
+};
+
+/* Comma-separated, sorted names of the children of a node, as returned by `tree_list`. */
+typedef struct Listing {
+    size_t length;
+    char string[];
+} Listing;
+
 struct Node {
     HashMap *children;
 
+#ifdef NODE_FUTEX_LOCK
+    /* Reader count, writer, waiting readers and writers, and the read-phase and move flags
+     * of the lock packed in a single futex word. See Node.c for the layout. */
+    atomic_uint lock;
+#else
     pthread_mutex_t mutex;
     pthread_cond_t read_cond; /* condition for readers to wait on */
     pthread_cond_t write_cond; /* condition for writers to wait on */
@@ -25,10 +53,99 @@ struct Node {
      * If the value is >0, a signaled reader may access the critical section. */
     int change;
 
+    /* Incremented every time a writer hands the node over to the waiting readers, so that
+     * under TREE_LOCK_PHASE_FAIR a reader can tell whether it was waiting at that moment. */
+    unsigned long read_phase;
+
     /* a process waiting on this condition is going to be the last process to access the node */
     pthread_cond_t move_cond;
+
+    /* processes waiting for their requests to be applied wait on this condition */
+    pthread_cond_t request_cond;
+#endif
+
+    /* Set while readers may access the node without locking it, only by publishing that they
+     * hold it in their own per-thread slots, which writers then have to scan. Enabled for the root
+     * and for nodes that the lock detects as heavily read, and revoked by writers. See Node.c. */
+    atomic_bool reader_bias;
+
+    /* Readers that have locked the node since it was last written. */
+    atomic_uint locked_reads;
+
+    /* Time, in nanoseconds, before which the reader bias mustn't be enabled again
+     * after a writer has revoked it. */
+    atomic_ulong bias_inhibited_until;
+
+    /* Odd while a writer has access to the node, incremented on every acquisition and release
+     * of write access. Lets waiting processes see without locking whether a writer is in.
+     * `children` itself can be read without locking the node, see HashMap.h. */
+    atomic_ulong version;
+
+    /* Requests published for the process that has write access to the node, the newest first,
+     * and whether that process is applying them. */
+    _Atomic(NodeRequest *) requests;
+    atomic_bool combining;
+#ifdef NODE_FUTEX_LOCK
+    /* Incremented whenever processes waiting for their requests may have to wake up. */
+    atomic_uint requests_round;
+#endif
+
+    /* Set while the node is being detached from its parent by a removal or a move,
+     * and for good once it has been removed. */
+    atomic_bool detaching;
+
+    /* Listing of `children`, built lazily by readers and dropped by writers that modify them.
+     * NULL if it hasn't been built since the last modification. */
+    _Atomic(Listing *) listing;
+
+    /* Ordered index of `children`, built lazily by readers and kept up to date by writers
+     * from then on. NULL if it hasn't been needed yet. */
+    _Atomic(ChildIndex *) index;
+
+    /* Folder containing the node while it's in the tree, NULL for the root. */
+    _Atomic(Node *) parent;
+
+    /* Incremented every time the node is taken from the pool or attached to a parent. Together
+     * with `detaching`, lets processes check that a node found without locks is still where
+     * it was found. */
+    atomic_ulong generation;
+
+    /* Statistics of the subtree below the node, kept up to date with atomics by the processes
+     * that modify it, without locking the ancestors. */
+    atomic_size_t descendants; /* Folders below the node. */
+    atomic_size_t name_bytes; /* Total length of their names. */
+    atomic_size_t height; /* Depth of the deepest of them, relative to the node, 0 if none. */
+
+    /* Changes of `children` that snapshots of the tree may still need to undo, the newest first.
+     * Empty while there are no snapshots. */
+    _Atomic(ChildEvent *) history;
+
+    /* The node in the tree's image whose children haven't been created yet, or NULL.
+     * They have to be created before `children` is accessed. */
+    _Atomic(const ImageNode *) image;
+
+    /* Next free node, while the node is kept in a NodePool. */
+    Node *next_free;
 };
 
+/* Selects the order in which waiting processes get access to nodes, and whether they spin
+ * for a while before they block. Must be called before any node is used. */
+void node_set_lock_policy(TreeLockPolicy policy, bool spin);
+
+/* Initializes the synchronization state of a new `node`. */
+void init_node_sync(Node *node);
+
+/* Lets readers of `node` access it without locking it, until a writer revokes it.
+ * For nodes that are expected to be read by most processes, like the root. */
+void prefer_readers(Node *node);
+
+/* Destroys the synchronization state of `node`. */
+void destroy_node_sync(Node *node);
+
+/* The most nodes a process holds or waits for access to at a time: a move keeps one parent
+ * while it descends to the other one with lock coupling. */
+#define MAX_NODES_HELD 3
+
 /* Acquires read access to `node`. */
 void get_read_access(Node *node);
 
@@ -38,6 +155,10 @@ void give_up_read_access(Node *node);
 /* Acquires write access to `node` */
 void get_write_access(Node *node);
 
+/* Acquires write access to `node` if no other process has or waits for access to it.
+ * Returns whether it has. */
+bool try_get_write_access(Node *node);
+
 /* Releases write access to `node`. */
 void give_up_write_access(Node *node);
 
@@ -47,4 +168,30 @@ void give_up_write_access(Node *node);
  * new incoming processes. */
 void get_move_access(Node *node);
 
+/* Publishes `request` for the process that has write access to `node` to apply, and waits
+ * until it has been applied, unless no process is applying requests, in which case the caller
+ * acquires write access to apply them itself. Returns false once the request has been applied,
+ * or true once the caller has write access and has to apply the published requests, taking them
+ * with `take_requests` until it calls `stop_combining`. Its own request may be among them,
+ * or may have been applied by another process already. */
+bool publish_request(Node *node, NodeRequest *request);
+
+/* Takes the requests published for `node`, the oldest first, or returns NULL if there are none. */
+NodeRequest *take_requests(Node *node);
+
+/* Marks the requests taken with `take_requests` as applied, waking up the processes that
+ * wait for them. */
+void complete_requests(Node *node, NodeRequest *requests);
+
+/* Stops applying the requests published for `node`, before the caller gives up write access.
+ * Processes whose requests are still published acquire write access to apply them instead. */
+void stop_combining(Node *node);
+
+/* Waits until no process holds or waits for access to `root` or any node below it.
+ * The caller must prevent processes from reaching the subtree from outside,
+ * by holding write access to its parent. Processes that reach it without locks must check
+ * afterwards whether it's been moved, and back off.
+ * Takes time proportional to the number of threads, not to the size of the subtree. */
+void subtree_wait(Node *root);
+
 #endif //NODE_H
@@ -0,0 +1,233 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "NodePool.h"
+#include "History.h"
+#include "err.h"
+
+/* Slabs are aligned to their size, so the slab of a node is found by masking its address. */
+#define SLAB_SIZE (64 * 1024)
+#define NODES_PER_SLAB ((SLAB_SIZE - sizeof(Slab)) / sizeof(Node))
+
+/* How many slabs are freed by a single task of `node_pool_free`. */
+#define SLABS_PER_TASK 16
+
+#define N_SHARDS 32
+
+/* How many nodes are moved at once between a shard and the shared part of the pool. */
+#define BATCH_SIZE 32
+
+/* A shard with more free nodes than that gives a batch back to the shared part of the pool. */
+#define MAX_SHARD_FREE (8 * BATCH_SIZE)
+
+typedef struct Slab Slab;
+
+struct Slab {
+    NodePool *pool;
+    Slab *next;
+    size_t used; /* Nodes handed out from this slab so far. */
+    Node nodes[];
+};
+
+typedef struct Shard {
+    _Alignas(64) pthread_mutex_t lock;
+    Node *free; /* Free nodes, linked by `next_free`. */
+    size_t free_count;
+} Shard;
+
+struct NodePool {
+    pthread_mutex_t lock; /* Protects everything but the shards. */
+    Slab *slabs; /* Newest slab first. */
+    Node *free;
+    size_t free_count;
+
+    Shard shards[N_SHARDS];
+};
+
+static atomic_uint next_shard = 0;
+static __thread int thread_shard = -1;
+
+static void lock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_lock(mutex) != 0)
+        syserr("lock failed");
+}
+
+static void unlock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_unlock(mutex) != 0)
+        syserr("unlock failed");
+}
+
+static Shard *get_shard(NodePool *pool) {
+    if (thread_shard < 0)
+        thread_shard = (int) (atomic_fetch_add(&next_shard, 1) % N_SHARDS);
+    return &pool->shards[thread_shard];
+}
+
+static Slab *slab_of(Node *node) {
+    return (Slab *) ((uintptr_t) node & ~(uintptr_t) (SLAB_SIZE - 1));
+}
+
+NodePool *node_pool_new() {
+    NodePool *pool = (NodePool *) calloc(1, sizeof(NodePool));
+    if (!pool)
+        fatal("out of memory");
+    if (pthread_mutex_init(&pool->lock, 0) != 0)
+        syserr("mutex init failed");
+    for (int i = 0; i < N_SHARDS; i++) {
+        if (pthread_mutex_init(&pool->shards[i].lock, 0) != 0)
+            syserr("mutex init failed");
+    }
+    return pool;
+}
+
+/* Frees a list of slabs together with their nodes. */
+static void free_slabs(Teardown *teardown, void *arg) {
+    (void) teardown;
+    for (Slab *slab = (Slab *) arg; slab;) {
+        for (size_t i = 0; i < slab->used; i++) {
+            destroy_node_sync(&slab->nodes[i]);
+            hmap_free(slab->nodes[i].children);
+            free(atomic_load(&slab->nodes[i].listing));
+            child_index_free(atomic_load(&slab->nodes[i].index));
+            history_free(atomic_load(&slab->nodes[i].history));
+        }
+        Slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+}
+
+void node_pool_free(NodePool *pool, Teardown *teardown) {
+    /* The slabs are split into batches, all but the last one freed by the workers. */
+    Slab *batch = pool->slabs;
+    while (batch) {
+        Slab *last = batch;
+        for (int i = 1; i < SLABS_PER_TASK && last->next; i++)
+            last = last->next;
+        Slab *next = last->next;
+        if (!next) {
+            free_slabs(teardown, batch);
+            break;
+        }
+        last->next = NULL;
+        teardown_submit(teardown, free_slabs, batch);
+        batch = next;
+    }
+    teardown_wait(teardown);
+
+    for (int i = 0; i < N_SHARDS; i++) {
+        if (pthread_mutex_destroy(&pool->shards[i].lock) != 0)
+            syserr("mutex destroy failed");
+    }
+    if (pthread_mutex_destroy(&pool->lock) != 0)
+        syserr("mutex destroy failed");
+    free(pool);
+}
+
+/* Takes a node that has never been used from the newest slab, allocating a new slab if needed.
+ * The caller must hold the pool's lock. */
+static Node *carve_node(NodePool *pool) {
+    Slab *slab = pool->slabs;
+    if (!slab || slab->used == NODES_PER_SLAB) {
+        slab = (Slab *) aligned_alloc(SLAB_SIZE, SLAB_SIZE);
+        if (!slab)
+            fatal("out of memory");
+        slab->pool = pool;
+        slab->used = 0;
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+    }
+
+    Node *node = &slab->nodes[slab->used++];
+    init_node_sync(node);
+    node->children = hmap_new();
+    if (!node->children)
+        fatal("out of memory");
+    atomic_init(&node->listing, NULL);
+    atomic_init(&node->index, NULL);
+    atomic_init(&node->generation, 0);
+    atomic_init(&node->descendants, 0);
+    atomic_init(&node->name_bytes, 0);
+    atomic_init(&node->height, 0);
+    atomic_init(&node->history, NULL);
+    atomic_init(&node->image, NULL);
+    return node;
+}
+
+/* Fills an empty shard with a batch of free nodes. */
+static void refill_shard(NodePool *pool, Shard *shard) {
+    lock(&pool->lock);
+    while (shard->free_count < BATCH_SIZE) {
+        Node *node;
+        if (pool->free) {
+            node = pool->free;
+            pool->free = node->next_free;
+            pool->free_count--;
+        }
+        else {
+            node = carve_node(pool);
+        }
+        node->next_free = shard->free;
+        shard->free = node;
+        shard->free_count++;
+    }
+    unlock(&pool->lock);
+}
+
+/* Moves a batch of free nodes from an overfull shard to the shared part of the pool. */
+static void drain_shard(NodePool *pool, Shard *shard) {
+    lock(&pool->lock);
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        Node *node = shard->free;
+        shard->free = node->next_free;
+        shard->free_count--;
+        node->next_free = pool->free;
+        pool->free = node;
+        pool->free_count++;
+    }
+    unlock(&pool->lock);
+}
+
+Node *node_pool_get(NodePool *pool) {
+    Shard *shard = get_shard(pool);
+
+    lock(&shard->lock);
+    if (!shard->free)
+        refill_shard(pool, shard);
+    Node *node = shard->free;
+    shard->free = node->next_free;
+    shard->free_count--;
+    unlock(&shard->lock);
+
+    node->next_free = NULL;
+    return node;
+}
+
+void node_pool_put(Node *node) {
+    NodePool *pool = slab_of(node)->pool;
+    Shard *shard = get_shard(pool);
+
+    /* A path cached through the node mustn't be valid anymore once it's cleared, whether
+     * or not the node was the root of the removed subtree, marked as detaching already. */
+    atomic_store(&node->detaching, true);
+    atomic_fetch_add(&node->generation, 1);
+
+    /* A process that has locked the node by a pointer kept from before, and has checked it
+     * before that, is waited for. Any later one sees the new generation. */
+    get_write_access(node);
+    give_up_write_access(node);
+
+    /* The index refers to the keys of the map, so it goes first. */
+    child_index_free(atomic_exchange(&node->index, NULL));
+    hmap_clear(node->children);
+    free(atomic_exchange(&node->listing, NULL));
+    history_free(atomic_exchange(&node->history, NULL));
+
+    lock(&shard->lock);
+    node->next_free = shard->free;
+    shard->free = node;
+    shard->free_count++;
+    if (shard->free_count > MAX_SHARD_FREE)
+        drain_shard(pool, shard);
+    unlock(&shard->lock);
+}
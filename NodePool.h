@@ -0,0 +1,30 @@
+#ifndef NODEPOOL_H
+#define NODEPOOL_H
+
+#include "Node.h"
+#include "Teardown.h"
+
+/* Allocates the nodes of a tree from large slabs.
+ * Freed nodes are recycled together with their initialized synchronization state and
+ * children map. Every thread allocates from and frees to its own shard of free nodes. */
+typedef struct NodePool NodePool;
+
+/* Creates a new, empty pool. */
+NodePool *node_pool_new();
+
+/* Frees the pool together with all nodes allocated from it, whether still in use or not,
+ * splitting the work of large pools with the workers of `teardown`.
+ * No other process may be using the pool or its nodes. */
+void node_pool_free(NodePool *pool, Teardown *teardown);
+
+/* Returns an idle node with an empty `children` map and no listing, index or history.
+ * Its other fields are left to the caller. */
+Node *node_pool_get(NodePool *pool);
+
+/* Gives `node` back to the pool it was allocated from,
+ * clearing its `children` map, listing, index and history, and invalidating the paths cached
+ * through it. Only processes that have locked it and check its generation may still be using
+ * the node, and are waited for. */
+void node_pool_put(Node *node);
+
+#endif //NODEPOOL_H
@@ -0,0 +1,91 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "PathCache.h"
+#include "epoch.h"
+#include "err.h"
+
+/* Number of entries, a power of two. Entries are direct-mapped. */
+#define CACHE_SIZE 8192
+
+/* Entries are never modified, only replaced, so they're read without locks. The arrays
+ * of the folder follow the entry, and are followed by the path. */
+typedef struct Entry {
+    uint64_t hash;
+    CachedFolder folder;
+    size_t length;
+    const char *path;
+} Entry;
+
+struct PathCache {
+    _Atomic(Entry *) entries[CACHE_SIZE];
+};
+
+/* FNV-1a. */
+static uint64_t hash_path(const char *path, size_t length) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char) path[i]) * 1099511628211ull;
+    return hash;
+}
+
+PathCache *path_cache_new() {
+    PathCache *cache = (PathCache *) malloc(sizeof(PathCache));
+    if (!cache)
+        fatal("out of memory");
+    for (size_t i = 0; i < CACHE_SIZE; i++)
+        atomic_init(&cache->entries[i], NULL);
+    return cache;
+}
+
+void path_cache_free(PathCache *cache) {
+    for (size_t i = 0; i < CACHE_SIZE; i++)
+        free(atomic_load_explicit(&cache->entries[i], memory_order_relaxed));
+    free(cache);
+}
+
+bool path_cache_get(PathCache *cache, const char *path, size_t length, CachedFolder *folder) {
+    uint64_t hash = hash_path(path, length);
+    Entry *entry = atomic_load_explicit(&cache->entries[hash & (CACHE_SIZE - 1)], memory_order_acquire);
+    if (!entry || entry->hash != hash || entry->length != length || memcmp(entry->path, path, length) != 0)
+        return false;
+    *folder = entry->folder;
+    return true;
+}
+
+void path_cache_put(PathCache *cache, const char *path, size_t length, const CachedFolder *folder) {
+    uint64_t hash = hash_path(path, length);
+    _Atomic(Entry *) *slot = &cache->entries[hash & (CACHE_SIZE - 1)];
+
+    /* Hot paths are looked up over and over, so the entry is only replaced if it's changed. */
+    size_t nodes_size = folder->depth * sizeof(Node *);
+    size_t generations_size = folder->depth * sizeof(unsigned long);
+    Entry *old = atomic_load_explicit(slot, memory_order_acquire);
+    if (old && old->hash == hash && old->length == length && memcmp(old->path, path, length) == 0
+        && old->folder.depth == folder->depth
+        && memcmp(old->folder.nodes, folder->nodes, nodes_size) == 0
+        && memcmp(old->folder.generations, folder->generations, generations_size) == 0)
+        return;
+
+    Entry *entry = (Entry *) malloc(sizeof(Entry) + nodes_size + generations_size + length + 1);
+    if (!entry)
+        fatal("out of memory");
+    Node **nodes = (Node **) (entry + 1);
+    unsigned long *generations = (unsigned long *) ((char *) nodes + nodes_size);
+    char *copy = (char *) generations + generations_size;
+    memcpy(nodes, folder->nodes, nodes_size);
+    memcpy(generations, folder->generations, generations_size);
+    memcpy(copy, path, length);
+    copy[length] = '\0';
+    entry->hash = hash;
+    entry->folder.depth = folder->depth;
+    entry->folder.nodes = nodes;
+    entry->folder.generations = generations;
+    entry->length = length;
+    entry->path = copy;
+
+    old = atomic_exchange_explicit(slot, entry, memory_order_acq_rel);
+    if (old)
+        epoch_retire(old, free);
+}
@@ -0,0 +1,36 @@
+#ifndef PATHCACHE_H
+#define PATHCACHE_H
+
+#include <stdbool.h>
+#include "Node.h"
+
+/* A cache of the folders found at full paths, shared by all processes without locks.
+ * Entries aren't kept up to date, so a folder found in the cache has to be validated
+ * by the caller with the generations of the folders on its path stored alongside it. A newer
+ * entry replaces an older one with the same hash. */
+typedef struct PathCache PathCache;
+
+/* What the cache knows about a path: the folders on it, below the root, with their generations
+ * when they were found there. The last one is the folder at the path. */
+typedef struct CachedFolder {
+    size_t depth;
+    Node *const *nodes;
+    const unsigned long *generations;
+} CachedFolder;
+
+/* Creates an empty cache. */
+PathCache *path_cache_new();
+
+/* Frees the cache. No other process may be using it. */
+void path_cache_free(PathCache *cache);
+
+/* Looks up the path made of the first `length` characters of `path`, filling `*folder`
+ * if it's in the cache. Must be called within an epoch critical section, until whose end
+ * the arrays of `*folder` remain valid. */
+bool path_cache_get(PathCache *cache, const char *path, size_t length, CachedFolder *folder);
+
+/* Stores what has been found at the path made of the first `length` characters of `path`,
+ * copying the arrays of `*folder`. Must be called within an epoch critical section. */
+void path_cache_put(PathCache *cache, const char *path, size_t length, const CachedFolder *folder);
+
+#endif //PATHCACHE_H
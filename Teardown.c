@@ -0,0 +1,157 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "Teardown.h"
+#include "err.h"
+
+/* Upper bound on the number of workers of an engine. */
+#define MAX_WORKERS 16
+
+typedef struct Task Task;
+
+struct Task {
+    TeardownTask run;
+    void *arg;
+    Task *next;
+};
+
+struct Teardown {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond; /* condition for workers to wait on for tasks */
+    pthread_cond_t idle_cond; /* condition for `teardown_wait` to wait on */
+
+    Task *tasks; /* Queued tasks, the newest first. */
+    unsigned pending; /* Tasks queued or running. */
+    atomic_uint idle; /* Workers waiting for tasks. */
+    bool stopping;
+
+    unsigned max_workers;
+    atomic_uint n_workers; /* Workers started so far. */
+    pthread_t workers[MAX_WORKERS];
+};
+
+static void lock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_lock(mutex) != 0)
+        syserr("lock failed");
+}
+
+static void unlock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_unlock(mutex) != 0)
+        syserr("unlock failed");
+}
+
+static void *worker(void *arg) {
+    Teardown *teardown = (Teardown *) arg;
+
+    lock(&teardown->lock);
+    while (true) {
+        while (!teardown->tasks && !teardown->stopping) {
+            atomic_fetch_add(&teardown->idle, 1);
+            if (pthread_cond_wait(&teardown->work_cond, &teardown->lock) != 0)
+                syserr("work cond wait failed");
+            atomic_fetch_sub(&teardown->idle, 1);
+        }
+        if (!teardown->tasks)
+            break;
+
+        Task *task = teardown->tasks;
+        teardown->tasks = task->next;
+        unlock(&teardown->lock);
+
+        task->run(teardown, task->arg);
+        free(task);
+
+        lock(&teardown->lock);
+        if (--teardown->pending == 0 && pthread_cond_broadcast(&teardown->idle_cond) != 0)
+            syserr("idle cond broadcast failed");
+    }
+    unlock(&teardown->lock);
+
+    return NULL;
+}
+
+Teardown *teardown_new(unsigned n_workers) {
+    Teardown *teardown = (Teardown *) calloc(1, sizeof(Teardown));
+    if (!teardown)
+        fatal("out of memory");
+
+    if (n_workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_workers = cpus > 0 ? (unsigned) cpus : 1;
+    }
+    teardown->max_workers = n_workers < MAX_WORKERS ? n_workers : MAX_WORKERS;
+
+    if (pthread_mutex_init(&teardown->lock, 0) != 0)
+        syserr("mutex init failed");
+    if (pthread_cond_init(&teardown->work_cond, 0) != 0)
+        syserr("work cond init failed");
+    if (pthread_cond_init(&teardown->idle_cond, 0) != 0)
+        syserr("idle cond init failed");
+    atomic_init(&teardown->idle, 0);
+    atomic_init(&teardown->n_workers, 0);
+
+    return teardown;
+}
+
+void teardown_free(Teardown *teardown) {
+    teardown_wait(teardown);
+
+    lock(&teardown->lock);
+    teardown->stopping = true;
+    if (pthread_cond_broadcast(&teardown->work_cond) != 0)
+        syserr("work cond broadcast failed");
+    unlock(&teardown->lock);
+
+    for (unsigned i = 0; i < atomic_load(&teardown->n_workers); i++) {
+        if (pthread_join(teardown->workers[i], NULL) != 0)
+            syserr("join failed");
+    }
+
+    if (pthread_cond_destroy(&teardown->idle_cond) != 0)
+        syserr("idle cond destroy failed");
+    if (pthread_cond_destroy(&teardown->work_cond) != 0)
+        syserr("work cond destroy failed");
+    if (pthread_mutex_destroy(&teardown->lock) != 0)
+        syserr("mutex destroy failed");
+    free(teardown);
+}
+
+void teardown_submit(Teardown *teardown, TeardownTask run, void *arg) {
+    Task *task = (Task *) malloc(sizeof(Task));
+    if (!task)
+        fatal("out of memory");
+    task->run = run;
+    task->arg = arg;
+
+    lock(&teardown->lock);
+    task->next = teardown->tasks;
+    teardown->tasks = task;
+    teardown->pending++;
+
+    /* A new worker is started only when no started one is free to take the task. */
+    unsigned n_workers = atomic_load(&teardown->n_workers);
+    if (atomic_load(&teardown->idle) == 0 && n_workers < teardown->max_workers) {
+        if (pthread_create(&teardown->workers[n_workers], NULL, worker, teardown) != 0)
+            syserr("create failed");
+        atomic_store(&teardown->n_workers, n_workers + 1);
+    }
+    else if (pthread_cond_signal(&teardown->work_cond) != 0) {
+        syserr("work cond signal failed");
+    }
+    unlock(&teardown->lock);
+}
+
+bool teardown_hungry(Teardown *teardown) {
+    return atomic_load(&teardown->idle) > 0
+           || atomic_load(&teardown->n_workers) < teardown->max_workers;
+}
+
+void teardown_wait(Teardown *teardown) {
+    lock(&teardown->lock);
+    while (teardown->pending > 0) {
+        if (pthread_cond_wait(&teardown->idle_cond, &teardown->lock) != 0)
+            syserr("idle cond wait failed");
+    }
+    unlock(&teardown->lock);
+}
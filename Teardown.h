@@ -0,0 +1,28 @@
+#ifndef TEARDOWN_H
+#define TEARDOWN_H
+
+#include <stdbool.h>
+
+/* A pool of worker threads that free memory, or search the tree, in the background.
+ * Work is submitted as tasks, which may submit further tasks themselves.
+ * Workers are started with the first task, so an unused engine costs no threads. */
+typedef struct Teardown Teardown;
+
+typedef void (*TeardownTask)(Teardown *teardown, void *arg);
+
+/* Creates an engine that runs tasks on up to `n_workers` threads, or on one per CPU if 0. */
+Teardown *teardown_new(unsigned n_workers);
+
+/* Waits for all tasks, stops the workers and frees the engine. */
+void teardown_free(Teardown *teardown);
+
+/* Schedules `task(teardown, arg)` to run on one of the workers. */
+void teardown_submit(Teardown *teardown, TeardownTask task, void *arg);
+
+/* Returns whether some worker is waiting for tasks, which makes it worth splitting work. */
+bool teardown_hungry(Teardown *teardown);
+
+/* Waits until every task submitted so far, and every task it submitted, has finished. */
+void teardown_wait(Teardown *teardown);
+
+#endif //TEARDOWN_H
@@ -2,70 +2,570 @@
 #include "Tree.h"
 #include <pthread.h>
 #include <string.h>
+#include <stdlib.h>
 #include <malloc.h>
+#include <sched.h>
+#include <time.h>
+#include <limits.h>
+#include <stddef.h>
+#include <fnmatch.h>
 #include "HashMap.h"
 #include "path_utils.h"
 #include "err.h"
 #include "Node.h"
+#include "NodePool.h"
+#include "Teardown.h"
+#include "History.h"
+#include "TreeImage.h"
+#include "Journal.h"
+#include "PathCache.h"
+#include "Watch.h"
+#include "epoch.h"
+
+/* How many times an optimistic traversal is retried before falling back to lock coupling. */
+#define OPTIMISTIC_ATTEMPTS 4
+
+/* How many batches of published requests a process applies to a folder at most before it gives up
+ * write access to it. */
+#define COMBINING_PASSES 4
+
+/* How many times `tree_move` yields before it starts to sleep between attempts to lock
+ * both parents, and the longest it sleeps. */
+#define MOVE_YIELDS 8
+#define MOVE_MAX_SLEEP_NS 1000000
+
+/* How many attempts to lock both parents optimistically a move makes before it waits
+ * to be the only move in progress and blocks on them. */
+#define MOVE_ATTEMPTS 16
+
+/* The folders a move that locks its parents together with other moves holds and waits for:
+ * the moved one and both parents. Claims are published in a list of the tree, and each is reused
+ * by one move at a time. `version` is odd while the claim isn't published, and changes whenever
+ * it's published or withdrawn, so that others can tell whether the nodes they've read belong
+ * together. */
+typedef struct MoveClaim MoveClaim;
+
+struct MoveClaim {
+    atomic_bool in_use;
+    atomic_ulong version;
+    _Atomic(Node *) nodes[3];
+    MoveClaim *next;
+};
+
+/* A folder removed while a snapshot that may still see it exists. */
+typedef struct Grave Grave;
+
+struct Grave {
+    Node *node;
+    unsigned long time; /* Time of the removal. */
+    Grave *next;
+};
 
+struct Snapshot {
+    Tree *tree;
+    unsigned long time; /* Changes stamped earlier are seen by the snapshot. */
+    Snapshot *next;
+    Snapshot *prev;
+};
 
 struct Tree {
     Node *root;
+    NodePool *pool;
+    Teardown *teardown; /* Frees removed subtrees and, eventually, the tree itself. */
+    Teardown *searchers; /* Run the parts of searches that are split off. */
+
+    /* Time of the next change or snapshot. */
+    atomic_ulong clock;
+    /* Number of snapshots, including those being taken. Changes are recorded while it's not 0. */
+    atomic_uint snapshot_count;
+    /* No snapshot earlier than that exists, ULONG_MAX if there are no snapshots. */
+    atomic_ulong oldest_snapshot;
+
+    pthread_mutex_t snapshots_lock; /* Protects the snapshots and the graveyard. */
+    Snapshot *snapshots;
+    Grave *graveyard;
+
+    PathCache *cache; /* Folders found at the paths looked up recently. */
+
+    TreeImage *image; /* The image the tree has been loaded from, or NULL. */
+    Journal *journal; /* NULL if the changes aren't journaled. */
+    pthread_mutex_t image_lock; /* Serializes creating the nodes of the image. */
+
+    /* Admits moves: those that lock their parents optimistically together, and one that has failed
+     * to do so too many times alone, see `move_folder`. Waiting exclusive moves go first.
+     * Moves take the mutex only to wait, or to wake those waiting. */
+    pthread_mutex_t moves_lock;
+    pthread_cond_t moves_cond; /* condition for moves to wait on */
+    atomic_uint shared_moves;
+    atomic_uint exclusive_moves; /* Waiting or in progress. */
+    bool exclusive_move; /* Protected by `moves_lock`. */
+    _Atomic(MoveClaim *) claims; /* Reused by the moves that lock their parents together. */
+
+    Watchers *watchers; /* Subscribers to the changes of the tree. */
 };
 
-void delete_node(Node *node) {
-    if (pthread_mutex_destroy(&node->mutex) != 0)
-        syserr("mutex destroy failed");
-    if (pthread_cond_destroy(&node->read_cond) != 0)
-        syserr("read cond destroy failed");
-    if (pthread_cond_destroy(&node->write_cond) != 0)
-        syserr("modify cond destroy failed");
+/* A change of the tree in progress. Changes are recorded in the histories of the nodes
+ * they modify, stamped with a single time, if snapshots of the tree exist,
+ * and appended to the journal if there is one. Once made, they're published to the watches
+ * they affect. */
+typedef struct Change {
+    Tree *tree;
+    JournalOp op;
+    const char *path;
+    const char *target;
+    unsigned long time; /* 0 if the change is neither recorded nor journaled. */
+    Stamp *stamp; /* NULL if the change isn't recorded. */
+    uint64_t ticket; /* 0 if the change isn't journaled. */
+    /* For JOURNAL_CREATE_ALL, the tokenized path, and how many of its components
+     * led to folders that existed before. */
+    const PathTokens *tokens;
+    size_t existing;
+} Change;
+
+/* Begins a change that is going to succeed, described by `op` and its paths for the journal.
+ * Nodes modified by it have to stay write-locked until it ends. */
+static void begin_change(Tree *tree, Change *change, JournalOp op, const char *path,
+                         const char *target) {
+    /* A snapshot that is being taken waits for the changes that haven't seen it. */
+    epoch_enter();
+    change->tree = tree;
+    change->op = op;
+    change->path = path;
+    change->target = target;
+    change->time = 0;
+    change->stamp = NULL;
+    change->ticket = 0;
+    change->tokens = NULL;
+    change->existing = 0;
+    bool recorded = atomic_load(&tree->snapshot_count) > 0;
+    if (!recorded && !tree->journal)
+        return;
+
+    /* The time is taken before anything is changed, so that a change that depends on
+     * the effects of another one is always later. */
+    change->time = atomic_fetch_add(&tree->clock, 1);
+    if (recorded)
+        change->stamp = stamp_new(change->time);
+    if (tree->journal)
+        change->ticket = journal_append(tree->journal, change->time, op, path, target);
+}
+
+/* Publishes a change that has been made to the watches of the tree. The nodes it modified are
+ * still locked, so that a change that depends on it is published later. */
+static void notify_change(Change *change) {
+    if (change->op == JOURNAL_CREATE_ALL) {
+        if (!watchers_any(change->tree->watchers))
+            return;
+
+        /* Every folder created gets its own event, as if it had been created by itself. */
+        const PathTokens *path = change->tokens;
+        char prefix[MAX_PATH_LENGTH + 1];
+        memcpy(prefix, path->path, path->length + 1);
+        for (size_t depth = change->existing + 1; depth <= path->depth; depth++) {
+            size_t length = path_tokens_prefix(path, depth);
+            char next = prefix[length];
+            prefix[length] = '\0';
+            watchers_notify(change->tree->watchers, TREE_EVENT_CREATE, prefix, NULL, false);
+            prefix[length] = next;
+        }
+        return;
+    }
 
-    hmap_free(node->children);
-    free(node);
+    TreeEventKind kind = TREE_EVENT_CREATE;
+    if (change->op == JOURNAL_REMOVE || change->op == JOURNAL_REMOVE_RECURSIVE)
+        kind = TREE_EVENT_REMOVE;
+    else if (change->op == JOURNAL_MOVE)
+        kind = TREE_EVENT_MOVE;
+    watchers_notify(change->tree->watchers, kind, change->path, change->target,
+                    change->op == JOURNAL_REMOVE_RECURSIVE || change->op == JOURNAL_MOVE);
 }
 
-/* Creates a new node and initializes its attributes. */
-Node *new_node() {
-    Node *node = (Node *) malloc(sizeof(Node));
+/* Ends a change, returning its time, or 0 if it hasn't been recorded. */
+static unsigned long end_change(Change *change) {
+    unsigned long time = 0;
+    notify_change(change);
+    if (change->stamp) {
+        time = change->time;
+        stamp_release(change->stamp);
+    }
+    epoch_exit();
+    return time;
+}
 
-    if (pthread_mutex_init(&node->mutex, 0) != 0)
-        syserr("mutex init failed");
-    if (pthread_cond_init(&node->read_cond, 0) != 0)
-        syserr("read cond init failed");
-    if (pthread_cond_init(&node->write_cond, 0) != 0)
-        syserr("modify cond init failed");
-    if (pthread_cond_init(&node->move_cond, 0) != 0)
-        syserr("move cond init failed");
-
-    node->change = 0;
-    node->writers_waiting = 0;
-    node->readers_waiting = 0;
-    node->writers_count = 0;
-    node->readers_count = 0;
-    node->children = hmap_new();
+/* Waits until an ended change is durable, if it's journaled.
+ * Should be called once the nodes it modified are unlocked. */
+static void commit_change(Change *change) {
+    if (change->ticket)
+        journal_commit(change->tree->journal, change->ticket);
+}
+
+/* Records that `child` is about to be attached to or detached from `parent`,
+ * and drops the events of `parent` that no snapshot needs anymore. */
+static void record_change(Change *change, Node *parent, const char *name, Node *child, bool attached) {
+    if (change->stamp)
+        history_record(parent, change->stamp, name, child, attached);
+    history_trim(parent, atomic_load(&change->tree->oldest_snapshot));
+}
+
+static void lock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_lock(mutex) != 0)
+        syserr("lock failed");
+}
+
+static void unlock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_unlock(mutex) != 0)
+        syserr("unlock failed");
+}
+
+static void delete_node(void *node) {
+    node_pool_put((Node *) node);
+}
+
+/* Returns a node that has been unlinked from the tree to its pool
+ * once no process can be reading it. */
+void retire_node(Node *node) {
+    epoch_retire(node, delete_node);
+}
+
+/* Returns the nodes of the subtree rooted at `root` to the pool, visiting them iteratively.
+ * Parts of the subtree still to be visited are handed over to the other workers while
+ * they're idle. No process may be using the subtree. */
+static void reap_subtree(Teardown *teardown, void *root) {
+    size_t capacity = 64, bottom = 0, top = 0;
+    Node **stack = (Node **) malloc(capacity * sizeof(Node *));
+    if (!stack)
+        fatal("out of memory");
+    stack[top++] = (Node *) root;
+
+    while (top > bottom) {
+        /* The bottom of the stack holds the shallowest, so usually the largest, subtrees. */
+        if (top - bottom > 1 && teardown_hungry(teardown))
+            teardown_submit(teardown, reap_subtree, stack[bottom++]);
+
+        Node *node = stack[--top];
+        HashMapIterator it = hmap_iterator(node->children);
+        const char *key;
+        void *value;
+        while (hmap_next(node->children, &it, &key, &value)) {
+            if (top == capacity) {
+                if (bottom > 0) {
+                    memmove(stack, stack + bottom, (top - bottom) * sizeof(Node *));
+                    top -= bottom;
+                    bottom = 0;
+                }
+                else {
+                    capacity *= 2;
+                    stack = (Node **) realloc(stack, capacity * sizeof(Node *));
+                    if (!stack)
+                        fatal("out of memory");
+                }
+            }
+            stack[top++] = (Node *) value;
+        }
+        node_pool_put(node);
+    }
+
+    free(stack);
+}
+
+/* Frees a subtree that has just been unlinked from the tree, once no process that may have
+ * found one of its nodes without locks can be reading it. */
+static void reap_unlinked_subtree(Teardown *teardown, void *root) {
+    epoch_synchronize();
+    reap_subtree(teardown, root);
+}
+
+/* Frees a folder that has been removed together with its subfolders. Small ones are freed
+ * right away, larger ones are left to the workers of the tree. */
+static void dispose_subtree(Tree *tree, Node *root) {
+    if (hmap_size(root->children) == 0)
+        retire_node(root);
+    else
+        teardown_submit(tree->teardown, reap_unlinked_subtree, root);
+}
+
+/* Frees a folder removed by a change stamped with `time`, or keeps it until no snapshot
+ * that can see it is left. */
+static void bury_subtree(Tree *tree, Node *root, unsigned long time) {
+    if (time > 0) {
+        lock(&tree->snapshots_lock);
+        if (time >= atomic_load(&tree->oldest_snapshot)) {
+            Grave *grave = (Grave *) malloc(sizeof(Grave));
+            if (!grave)
+                fatal("out of memory");
+            grave->node = root;
+            grave->time = time;
+            grave->next = tree->graveyard;
+            tree->graveyard = grave;
+            root = NULL;
+        }
+        unlock(&tree->snapshots_lock);
+    }
+
+    if (root)
+        dispose_subtree(tree, root);
+}
+
+/* Creates a new node and initializes its attributes. */
+Node *new_node(NodePool *pool) {
+    Node *node = node_pool_get(pool);
+
+    /* A recycled node mustn't be taken for the folder it was before, so its generation changes
+     * before it stops being marked as detached. */
+    atomic_fetch_add(&node->generation, 1);
+    atomic_store(&node->version, 0);
+    atomic_store(&node->detaching, false);
+    atomic_store(&node->parent, NULL);
+    atomic_store(&node->image, NULL);
+    atomic_store(&node->descendants, 0);
+    atomic_store(&node->name_bytes, 0);
+    atomic_store(&node->height, 0);
 
     return node;
 }
 
-/* Acquires write access to the folder indicated by the path.
+/* Creates the children of `node` that are still only in the tree's image.
+ * Has to be called before `node->children` is accessed in any way. */
+static void load_children(Tree *tree, Node *node) {
+    if (!atomic_load_explicit(&node->image, memory_order_acquire))
+        return;
+
+    /* Nobody can access the children before they're all created, so nobody can be
+     * modifying them either. */
+    lock(&tree->image_lock);
+    const ImageNode *image_node = atomic_load(&node->image);
+    if (image_node) {
+        for (uint32_t i = 0; i < image_node->child_count; i++) {
+            const char *name;
+            const ImageNode *child_image = image_child(tree->image, image_node, i, &name);
+            Node *child = new_node(tree->pool);
+            atomic_store(&child->image, child_image->child_count > 0 ? child_image : NULL);
+            /* The image has been checked when it was opened, so siblings' names differ. */
+            hmap_insert(node->children, name, child);
+            atomic_store(&child->parent, node);
+            atomic_fetch_add(&child->generation, 1);
+            atomic_store(&child->descendants, child_image->descendants);
+            atomic_store(&child->name_bytes, child_image->name_bytes);
+            atomic_store(&child->height, child_image->max_depth);
+        }
+        atomic_store_explicit(&node->image, NULL, memory_order_release);
+    }
+    unlock(&tree->image_lock);
+}
+
+/* Drops the listing of `node`, whose children are about to change.
+ * The caller must have write access to `node`. */
+static void invalidate_listing(Node *node) {
+    free(atomic_exchange(&node->listing, NULL));
+}
+
+/* Adds `child` to the children of `parent` under `name` as a part of `change`.
+ * The caller must have write access to `parent`. */
+void attach_child(Change *change, Node *parent, const char *name, Node *child) {
+    record_change(change, parent, name, child, true);
+    invalidate_listing(parent);
+    hmap_insert(parent->children, name, child);
+    atomic_store(&child->parent, parent);
+    atomic_fetch_add(&child->generation, 1);
+
+    ChildIndex *index = atomic_load(&parent->index);
+    if (index)
+        child_index_insert(index, hmap_get_key(parent->children, name));
+}
+
+/* Removes the child named `name` from the children of `parent` as a part of `change`.
+ * The caller must have write access to `parent`. */
+void detach_child(Change *change, Node *parent, const char *name) {
+    record_change(change, parent, name, (Node *) hmap_get(parent->children, name), false);
+    invalidate_listing(parent);
+
+    ChildIndex *index = atomic_load(&parent->index);
+    if (index)
+        child_index_remove(index, name);
+    hmap_remove(parent->children, name);
+}
+
+/* Adds a subtree of `folders` folders, whose names take `bytes` bytes, to the statistics of
+ * `node` and of its ancestors below `stop`, or takes it away if `removed` is set.
+ * The caller must have write access to `node`, which keeps its ancestors in place. */
+static void count_subtree(Node *node, Node *stop, size_t folders, size_t bytes, bool removed) {
+    for (; node != stop; node = atomic_load(&node->parent)) {
+        if (removed) {
+            atomic_fetch_sub(&node->descendants, folders);
+            atomic_fetch_sub(&node->name_bytes, bytes);
+        }
+        else {
+            atomic_fetch_add(&node->descendants, folders);
+            atomic_fetch_add(&node->name_bytes, bytes);
+        }
+    }
+}
+
+/* Raises the heights of `node` and its ancestors after a subtree of `height` has been attached
+ * to `node`. The caller must have write access to `node`. */
+static void raise_height(Node *node, size_t height) {
+    for (size_t depth = height + 1; node; node = atomic_load(&node->parent), depth++) {
+        size_t current = atomic_load(&node->height);
+        do {
+            /* The ancestors are then at least as high too. */
+            if (current >= depth)
+                return;
+        } while (!atomic_compare_exchange_weak(&node->height, &current, depth));
+    }
+}
+
+/* Computes the height of `node` from its children, but stops looking once it reaches `bound`.
+ * Must be called within an epoch critical section. */
+static size_t compute_height(Node *node, size_t bound) {
+    size_t height = 0;
+    const char *key;
+    void *value;
+    HashMapIterator it = hmap_iterator(node->children);
+    while (height < bound && hmap_next(node->children, &it, &key, &value)) {
+        size_t child_height = atomic_load(&((Node *) value)->height) + 1;
+        if (child_height > height)
+            height = child_height;
+    }
+    return height;
+}
+
+/* Lowers the heights of `node` and its ancestors after a subtree has been detached from `node`,
+ * recomputing them from their children for as long as they change.
+ * The caller must have write access to `node`. */
+static void lower_height(Node *node) {
+    /* Other processes may change the heights of the same folders at the same time, each of them
+     * changing a folder only after its child. A height raised meanwhile makes ours fail to be set,
+     * and one lowered meanwhile is recomputed by its process afterwards. */
+    epoch_enter();
+    for (; node; node = atomic_load(&node->parent)) {
+        size_t current = atomic_load(&node->height), height;
+        do {
+            height = compute_height(node, current);
+        } while (height != current && !atomic_compare_exchange_strong(&node->height, &current, height));
+        if (height == current)
+            break;
+    }
+    epoch_exit();
+}
+
+/* Updates the statistics of `node`, which the caller has write access to, after `created`
+ * children with names of `created_bytes` bytes have been attached to it and `removed` ones
+ * of `removed_bytes` bytes detached. The attached ones are counted first, so that the statistics
+ * never count fewer folders than there are. */
+static void count_children(Node *node, size_t created, size_t created_bytes, size_t removed,
+                           size_t removed_bytes) {
+    if (created > 0) {
+        count_subtree(node, NULL, created, created_bytes, false);
+        raise_height(node, 0);
+    }
+    if (removed > 0) {
+        count_subtree(node, NULL, removed, removed_bytes, true);
+        lower_height(node);
+    }
+}
+
+/* Returns the ordered index of the children of `node`, building it if there is none.
+ * The caller must have read access to `node`, which keeps the index unchanged. */
+static ChildIndex *get_index(Node *node) {
+    ChildIndex *index = atomic_load(&node->index);
+    if (index)
+        return index;
+
+    ChildIndex *new_index = child_index_new(node->children);
+
+    /* Other readers may be building the same index at the same time. */
+    if (atomic_compare_exchange_strong(&node->index, &index, new_index))
+        return new_index;
+    child_index_free(new_index);
+    return index;
+}
+
+/* Copies names from `index`, starting at `cursor`, into a new comma-separated string,
+ * allocated together with `header` bytes before it, and returns the allocation.
+ * Copies at most `limit` names and sets `*count` to the number of names copied and
+ * `*length` to the length of the string. */
+static char *join_names(ChildIndex *index, ChildIndexCursor *cursor, size_t limit, size_t header,
+                        size_t *count, size_t *length) {
+    /* The names are measured first, so that the string is allocated once. */
+    ChildIndexCursor start = *cursor;
+    size_t n = 0, total = 0;
+    const char *name;
+    while (n < limit && (name = child_index_next(index, cursor))) {
+        total += strlen(name) + (n > 0);
+        n++;
+    }
+
+    char *allocation = (char *) malloc(header + total + 1);
+    if (!allocation)
+        fatal("out of memory");
+    char *end = allocation + header;
+    for (size_t i = 0; i < n; i++) {
+        if (i > 0)
+            *end++ = ',';
+        name = child_index_next(index, &start);
+        size_t name_length = strlen(name);
+        memcpy(end, name, name_length);
+        end += name_length;
+    }
+    *end = '\0';
+
+    *count = n;
+    *length = total;
+    return allocation;
+}
+
+/* Returns the listing of `node`, building it if there is none.
+ * The caller must have read access to `node`, which keeps the listing valid. */
+static Listing *get_listing(Node *node) {
+    Listing *listing = atomic_load(&node->listing);
+    if (listing)
+        return listing;
+
+    ChildIndex *index = get_index(node);
+    ChildIndexCursor cursor = child_index_seek(index, NULL);
+    size_t count, length;
+    Listing *new_listing = (Listing *) join_names(index, &cursor, child_index_size(index),
+                                                  offsetof(Listing, string), &count, &length);
+    new_listing->length = length;
+
+    /* Other readers may be building the same listing at the same time. */
+    if (atomic_compare_exchange_strong(&node->listing, &listing, new_listing))
+        return new_listing;
+    free(new_listing);
+    return listing;
+}
+
+/* Returns the child of `node` named by the component `i` of the path, or NULL if there's none. */
+static inline Node *get_child(Node *node, const PathTokens *path, size_t i) {
+    const PathComponent *component = &path->components[i];
+    return (Node *) hmap_get_hashed(node->children, path->path + component->offset,
+                                    component->length, component->hash);
+}
+
+/* Copies the name of the last of the first `depth` components of the path to `name`,
+ * a buffer of size at least MAX_FOLDER_NAME_LENGTH + 1. */
+static void copy_name(const PathTokens *path, size_t depth, char *name) {
+    const PathComponent *component = &path->components[depth - 1];
+    memcpy(name, path->path + component->offset, component->length);
+    name[component->length] = '\0';
+}
+
+/* Acquires write access to the folder indicated by the first `depth` components of the path.
  * Args:
  * - `node`: a node corresponding to the first folder in the path
- * - `path`: a valid path
+ * - `path`: a tokenized path
  * - `root_access`: true if the calling proccess already has access to `node`
  * If `root_access` is set to true, the function doesn't release access to `node`
  * whilst traversing the tree. */
-Node *write_folder(Node *node, const char *path, const bool root_access) {
+Node *write_folder(Tree *tree, Node *node, const PathTokens *path, size_t depth,
+                   const bool root_access) {
     if (!node)
         return NULL;
 
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
     const Node *root = node;
-    const char *subpath = path;
     Node *new_node;
 
-    subpath = split_path(subpath, component);
-    if (!subpath) {
+    if (depth == 0) {
         if (!root_access)
             get_write_access(node);
         return node;
@@ -73,17 +573,17 @@ Node *write_folder(Node *node, const char *path, const bool root_access) {
     if (!root_access)
         get_read_access(node);
 
-    do {
+    for (size_t i = 0; i < depth; i++) {
         /* Searches for next node in the hashmap of the current one. */
-        new_node = (Node *) hmap_get(node->children, component);
+        load_children(tree, node);
+        new_node = get_child(node, path, i);
         if (!new_node) {
             if (!root_access || node != root)
                 give_up_read_access(node);
             return new_node;
         }
         /* Checks if the next node is going to be the last and gets access to it. */
-        subpath = split_path(subpath, component);
-        if (subpath)
+        if (i + 1 < depth)
             get_read_access(new_node);
         else
             get_write_access(new_node);
@@ -93,22 +593,22 @@ Node *write_folder(Node *node, const char *path, const bool root_access) {
             give_up_read_access(node);
 
         node = new_node;
-    } while (subpath);
+    }
 
     return node;
 }
 
-/* Returns a node represented by the path and acquires a read access to it. */
-Node *read_folder(Tree *tree, const char *path) {
-    char component[MAX_FOLDER_NAME_LENGTH + 1];
-    const char *subpath = path;
+/* Returns a node represented by the first `depth` components of the path
+ * and acquires a read access to it. */
+Node *read_folder(Tree *tree, const PathTokens *path, size_t depth) {
     Node *node = tree->root;
     Node *new_node;
 
     get_read_access(node);
 
-    while (node && (subpath = split_path(subpath, component))) {
-        new_node = (Node *) hmap_get(node->children, component);
+    for (size_t i = 0; node && i < depth; i++) {
+        load_children(tree, node);
+        new_node = get_child(node, path, i);
         if (new_node)
             get_read_access(new_node);
         give_up_read_access(node);
@@ -118,120 +618,849 @@ Node *read_folder(Tree *tree, const char *path) {
     return node;
 }
 
-int tree_remove(Tree *tree, const char *path) {
-    if (!is_path_valid(path))
-        return EINVAL;
+/* How many folders of a path are traced without allocating memory. */
+#define TRACE_INLINE_DEPTH 32
+
+/* The folders on a path resolved without locks, with their generations at the time. */
+typedef struct PathTrace {
+    size_t depth;
+    size_t capacity;
+    Node **nodes;
+    unsigned long *generations;
+    Node *inline_nodes[TRACE_INLINE_DEPTH];
+    unsigned long inline_generations[TRACE_INLINE_DEPTH];
+} PathTrace;
+
+static void trace_init(PathTrace *trace) {
+    trace->depth = 0;
+    trace->capacity = TRACE_INLINE_DEPTH;
+    trace->nodes = trace->inline_nodes;
+    trace->generations = trace->inline_generations;
+}
 
-    /* Searching for the parent folder and getting a write access to it. */
-    char last_component[MAX_FOLDER_NAME_LENGTH + 1];
-    char *initial_subpath = make_path_to_parent(path, last_component);
-    const char *subpath = initial_subpath;
+static void trace_destroy(PathTrace *trace) {
+    if (trace->nodes != trace->inline_nodes) {
+        free(trace->nodes);
+        free(trace->generations);
+    }
+}
 
-    if (!subpath) /* tried to remove the root */
-        return EBUSY;
+static void trace_push(PathTrace *trace, Node *node, unsigned long generation) {
+    if (trace->depth == trace->capacity) {
+        /* Paths are rarely that deep, so the trace is simply moved to the heap. */
+        trace->capacity = MAX_PATH_DEPTH;
+        Node **nodes = (Node **) malloc(trace->capacity * sizeof(Node *));
+        unsigned long *generations = (unsigned long *) malloc(trace->capacity * sizeof(unsigned long));
+        if (!nodes || !generations)
+            fatal("out of memory");
+        memcpy(nodes, trace->nodes, trace->depth * sizeof(Node *));
+        memcpy(generations, trace->generations, trace->depth * sizeof(unsigned long));
+        trace->nodes = nodes;
+        trace->generations = generations;
+    }
+    trace->nodes[trace->depth] = node;
+    trace->generations[trace->depth] = generation;
+    trace->depth++;
+}
 
-    Node *node = write_folder(tree->root, subpath, false);
+/* Checks whether the folders on a path are still where they were found: none of them
+ * has been attached anywhere since, and none of them is being detached. */
+static bool validate_folders(Node *const *nodes, const unsigned long *generations, size_t depth) {
+    for (size_t i = 0; i < depth; i++) {
+        Node *node = nodes[i];
+        if (atomic_load(&node->detaching) || atomic_load(&node->generation) != generations[i])
+            return false;
+    }
+    return true;
+}
 
-    free(initial_subpath);
-    if (!node)
-        return ENOENT;
+/* Checks whether the folders on a resolved path are still where they were found. */
+static bool validate_path(PathTrace *trace) {
+    return validate_folders(trace->nodes, trace->generations, trace->depth);
+}
 
-    /* Making sure the folder we want to delete exists. */
-    void *child = hmap_get(node->children, last_component);
+/* Finds the folder indicated by the first `depth` components of the path without locking
+ * any node on the way.
+ * `held` is a folder the caller has write access to, or NULL.
+ * Returns false if the attempt has to be repeated. Otherwise sets `*result` to the folder,
+ * or to NULL if it doesn't exist. A folder that has been found has to be validated with
+ * `validate_path` once the caller has access to it.
+ * `trace` must have been initialized, and is extended with the folders on the path.
+ * Folders already in it are taken as the first folders on the path, found earlier. */
+static bool resolve_path(Tree *tree, const PathTokens *path, size_t depth, Node *held,
+                         PathTrace *trace, Node **result) {
+    size_t i = trace->depth;
+    Node *node = i > 0 ? trace->nodes[i - 1] : tree->root;
+
+    for (; i < depth; i++) {
+        load_children(tree, node);
+
+        /* Lookups don't wait for writers of the parent. */
+        Node *child = get_child(node, path, i);
+        if (!child) {
+            *result = NULL;
+            return validate_path(trace);
+        }
 
-    if (!child) {
+        /* The child is looked up again after its generation is read, so that it's known to have
+         * been in the parent with that generation. If it's been attached anywhere since,
+         * validating the trace will tell. */
+        unsigned long generation = atomic_load(&child->generation);
+        if (node != held && get_child(node, path, i) != child)
+            return false;
+        trace_push(trace, child, generation);
+        node = child;
+    }
+
+    *result = node;
+    return true;
+}
+
+/* Tries to find the folder indicated by the first `depth` components of the path without
+ * locking any node on the way, and acquires access to it.
+ * Returns false if the attempt has to be repeated. Otherwise sets `*result` to the folder,
+ * or to NULL if it doesn't exist. */
+static bool try_optimistic_folder(Tree *tree, const PathTokens *path, size_t depth, bool write,
+                                  Node **result) {
+    PathTrace trace;
+    Node *node;
+    bool done = false;
+
+    trace_init(&trace);
+    if (resolve_path(tree, path, depth, NULL, &trace, &node)) {
+        if (node) {
+            if (write)
+                get_write_access(node);
+            else
+                get_read_access(node);
+
+            /* Any removal or move that begins from now on waits for us to give up access. One that
+             * has begun earlier has marked a folder on the path as detaching,
+             * or attached it elsewhere. */
+            done = validate_path(&trace);
+            if (!done && write)
+                give_up_write_access(node);
+            else if (!done)
+                give_up_read_access(node);
+        }
+        else {
+            done = true;
+        }
+    }
+
+    if (done && node && trace.depth > 0) {
+        CachedFolder cached = { trace.depth, trace.nodes, trace.generations };
+        path_cache_put(tree->cache, path->path, path_tokens_prefix(path, depth), &cached);
+    }
+    trace_destroy(&trace);
+
+    if (done)
+        *result = node;
+    return done;
+}
+
+/* Checks whether a folder from the path cache is still at its path: neither it nor any folder
+ * above it has been attached anywhere since, and none of them is being detached. A move or
+ * a removal only invalidates the paths that go through the folder it detaches. */
+static bool validate_cached(const CachedFolder *cached) {
+    return validate_folders(cached->nodes, cached->generations, cached->depth);
+}
+
+/* Tries to find the folder indicated by the first `depth` components of the path in the path
+ * cache, and acquires access to it. Returns NULL if it isn't cached, or has changed since. */
+static Node *try_cached_folder(Tree *tree, const PathTokens *path, size_t depth, bool write) {
+    CachedFolder cached;
+    if (!path_cache_get(tree->cache, path->path, path_tokens_prefix(path, depth), &cached)
+        || !validate_cached(&cached))
+        return NULL;
+
+    Node *node = cached.nodes[cached.depth - 1];
+    if (write)
+        get_write_access(node);
+    else
+        get_read_access(node);
+
+    /* Validated again like a resolved path, once any removal or move that begins from now on
+     * waits for us. */
+    if (validate_cached(&cached))
+        return node;
+    if (write)
         give_up_write_access(node);
+    else
+        give_up_read_access(node);
+    return NULL;
+}
+
+/* Acquires read or write access to the folder indicated by the first `depth` components
+ * of the path. Returns NULL if the folder doesn't exist.
+ * The folder is first looked up in the path cache, and then the path is resolved optimistically,
+ * locking only the folder itself in both cases. If that fails repeatedly, the tree is traversed
+ * with lock coupling instead. */
+Node *lock_folder(Tree *tree, const PathTokens *path, size_t depth, bool write) {
+    Node *node;
+    bool found = false;
+
+    epoch_enter();
+    if ((node = try_cached_folder(tree, path, depth, write)))
+        found = true;
+    for (int attempt = 0; attempt < OPTIMISTIC_ATTEMPTS && !found; attempt++)
+        found = try_optimistic_folder(tree, path, depth, write, &node);
+    epoch_exit();
+
+    if (!found)
+        node = write ? write_folder(tree, tree->root, path, depth, false)
+                     : read_folder(tree, path, depth);
+    if (node)
+        load_children(tree, node);
+    return node;
+}
+
+/* Removes the empty folder at the path from `node`, its parent, which the caller has write
+ * access to and keeps. Leaves the statistics to the caller. On success, sets `*child` to
+ * the folder and `*time` to the time of `change`, to be buried and committed once the parent
+ * is unlocked. */
+static int remove_child(Tree *tree, Node *node, const PathTokens *path, Change *change,
+                        Node **child, unsigned long *time) {
+    char last_component[MAX_FOLDER_NAME_LENGTH + 1];
+    copy_name(path, path->depth, last_component);
+
+    /* Making sure the folder we want to delete exists. */
+    *child = get_child(node, path, path->depth - 1);
+    if (!*child)
         return ENOENT;
-    }
 
-    /* Waiting for other processes in the folder to finish. */
-    get_move_access(child);
+    /* Waiting for other processes in the folder to finish. Processes that reached it
+     * without locking the parent will see it's being removed and back off. */
+    atomic_store(&(*child)->detaching, true);
+    get_move_access(*child);
+    load_children(tree, *child);
 
     /* Making sure the folder is empty */
-    if (hmap_size(((Node *) child)->children) > 0) {
-        give_up_write_access(node);
+    if (hmap_size((*child)->children) > 0) {
+        atomic_store(&(*child)->detaching, false);
         return ENOTEMPTY;
     }
 
-    /* Removing the folder and unlocking its parent. */
-    hmap_remove(node->children, last_component);
-    delete_node(child);
-    give_up_write_access(node);
+    begin_change(tree, change, JOURNAL_REMOVE, path->path, NULL);
+    detach_child(change, node, last_component);
+    *time = end_change(change);
     return 0;
 }
 
-int tree_create(Tree *tree, const char *path) {
-    if (!is_path_valid(path))
-        return EINVAL;
-
-    /* Searching for the parent folder and getting write access to it. */
+/* Creates the folder at the path in `node`, its parent, which the caller has write access to
+ * and keeps. Leaves the statistics to the caller, and `change` to be committed once the parent
+ * is unlocked. */
+static int create_child(Tree *tree, Node *node, const PathTokens *path, Change *change) {
     char last_component[MAX_FOLDER_NAME_LENGTH + 1];
-    char *initial_subpath = make_path_to_parent(path, last_component);
-    const char *subpath = initial_subpath;
+    copy_name(path, path->depth, last_component);
 
-    if (!subpath)
+    /* Making sure the folder we want to create doesn't already exist. */
+    if (get_child(node, path, path->depth - 1))
         return EEXIST;
 
-    Node *node = write_folder(tree->root, subpath, false);
+    Node *new_folder = new_node(tree->pool);
+    begin_change(tree, change, JOURNAL_CREATE, path->path, NULL);
+    attach_child(change, node, last_component, new_folder);
+    end_change(change);
+    return 0;
+}
 
-    free(initial_subpath);
+/* A creation or a removal of a folder, applied to its parent either by the process that makes it
+ * or by the process that has write access to the parent, together with the others published
+ * meanwhile. See `request_child_change`. */
+typedef struct ChildRequest {
+    NodeRequest link; /* Must come first. */
+    JournalOp op; /* JOURNAL_CREATE or JOURNAL_REMOVE. */
+    const PathTokens *path;
+
+    /* How the parent has been found, to be validated once it's locked: in the path cache,
+     * or by resolving the path. Neither if it's been found with lock coupling. */
+    const CachedFolder *cached;
+    PathTrace *trace;
+
+    /* Set once the request is applied. */
+    bool stale; /* The parent wasn't at the path anymore, so the request has to be made again. */
+    int result;
+    /* If it has succeeded, the change to be committed and the removed folder to be buried
+     * with the time of its removal, by the process that has made it. */
+    Change change;
+    Node *child;
+    unsigned long time;
+} ChildRequest;
+
+/* Applies `request` to `node`, the parent of its folder, which the caller has write access to
+ * and keeps. Leaves the statistics to the caller. */
+static void apply_child_request(Tree *tree, Node *node, ChildRequest *request) {
+    if (request->cached)
+        request->stale = !validate_cached(request->cached);
+    else
+        request->stale = request->trace && !validate_path(request->trace);
+    if (request->stale)
+        return;
 
-    if (!node)
-        return ENOENT;
+    if (request->op == JOURNAL_CREATE)
+        request->result = create_child(tree, node, request->path, &request->change);
+    else
+        request->result = remove_child(tree, node, request->path, &request->change,
+                                       &request->child, &request->time);
+}
 
-    /* Making sure the folder we want to create doesn't already exist. */
-    Node *child = (Node *) hmap_get(node->children, last_component);
+/* Applies the requests published for `node`, which the caller has acquired write access to with
+ * `publish_request` and keeps, updating the statistics once for all those taken together. */
+static void combine_child_requests(Tree *tree, Node *node) {
+    load_children(tree, node);
+
+    /* New requests may keep coming, so the caller stops at some point and leaves the rest
+     * to their processes. */
+    NodeRequest *requests;
+    for (int pass = 0; pass < COMBINING_PASSES && (requests = take_requests(node)); pass++) {
+        size_t created = 0, created_bytes = 0, removed = 0, removed_bytes = 0;
+        for (NodeRequest *link = requests; link; link = link->next) {
+            ChildRequest *request = (ChildRequest *) link;
+            apply_child_request(tree, node, request);
+            if (request->stale || request->result != 0)
+                continue;
+
+            size_t length = request->path->components[request->path->depth - 1].length;
+            if (request->op == JOURNAL_CREATE) {
+                created++;
+                created_bytes += length;
+            }
+            else {
+                removed++;
+                removed_bytes += length;
+            }
+        }
+        count_children(node, created, created_bytes, removed, removed_bytes);
+        complete_requests(node, requests);
+    }
+    stop_combining(node);
+}
 
-    if (child) {
+/* Makes `request` to `node`, the parent of its folder, found without locks, and waits until it's
+ * been applied. Returns false if the parent has turned out not to be at the path anymore. */
+static bool submit_child_request(Tree *tree, Node *node, ChildRequest *request) {
+    if (publish_request(node, &request->link)) {
+        combine_child_requests(tree, node);
         give_up_write_access(node);
-        return EEXIST;
     }
+    return !request->stale;
+}
 
-    Node *new_folder = new_node();
-    hmap_insert(node->children, last_component, new_folder);
+/* Applies `request` to the parent of its folder, found like in `lock_folder`, and sets its result.
+ * Instead of waiting for write access to a parent that other processes are changing, the request
+ * is published for the process that has it to apply, so that the changes of a folder that many
+ * processes change at once are applied in batches, rather than handing the lock over for each. */
+static void request_child_change(Tree *tree, ChildRequest *request) {
+    const PathTokens *path = request->path;
+    size_t depth = path->depth - 1;
+    CachedFolder cached;
+    PathTrace trace;
+    bool done = false, missing = false;
+
+    trace_init(&trace);
+    epoch_enter();
+    if (path_cache_get(tree->cache, path->path, path_tokens_prefix(path, depth), &cached)
+        && validate_cached(&cached)) {
+        request->cached = &cached;
+        request->trace = NULL;
+        done = submit_child_request(tree, cached.nodes[cached.depth - 1], request);
+    }
+    for (int attempt = 0; attempt < OPTIMISTIC_ATTEMPTS && !done; attempt++) {
+        Node *node;
+        trace.depth = 0;
+        if (!resolve_path(tree, path, depth, NULL, &trace, &node))
+            continue;
+        if (!node) {
+            missing = true;
+            break;
+        }
 
+        request->cached = NULL;
+        request->trace = &trace;
+        done = submit_child_request(tree, node, request);
+        if (done && trace.depth > 0) {
+            CachedFolder found = { trace.depth, trace.nodes, trace.generations };
+            path_cache_put(tree->cache, path->path, path_tokens_prefix(path, depth), &found);
+        }
+    }
+    epoch_exit();
+    trace_destroy(&trace);
+    if (done)
+        return;
+
+    /* The parent found with lock coupling is known to be at the path, and doesn't wait
+     * for published requests. */
+    Node *node = missing ? NULL : write_folder(tree, tree->root, path, depth, false);
+    if (!node) {
+        request->result = ENOENT;
+        return;
+    }
+    load_children(tree, node);
+    request->cached = NULL;
+    request->trace = NULL;
+    apply_child_request(tree, node, request);
+    if (request->result == 0) {
+        size_t length = path->components[depth].length;
+        if (request->op == JOURNAL_CREATE)
+            count_children(node, 1, length, 0, 0);
+        else
+            count_children(node, 0, 0, 1, length);
+    }
     give_up_write_access(node);
-    return 0;
 }
 
-/* Removes `node` and its subtree.
- * No other process is allowed to work in `node` or its subtree the moment this function is called. */
-void remove_nodes(Node *node) {
-    HashMapIterator hm = hmap_iterator(node->children);
-    const char *key;
-    void *value;
-    while (hmap_next(node->children, &hm, &key, &value))
-        remove_nodes((Node *) value);
+/* Removes the empty folder at the path. */
+static int remove_folder(Tree *tree, const PathTokens *path) {
+    if (path->depth == 0) /* tried to remove the root */
+        return EBUSY;
+
+    ChildRequest request = { .op = JOURNAL_REMOVE, .path = path };
+    request_child_change(tree, &request);
+    if (request.result == 0) {
+        bury_subtree(tree, request.child, request.time);
+        commit_change(&request.change);
+    }
+    return request.result;
+}
 
-    delete_node(node);
+int tree_remove(Tree *tree, const char *path) {
+    PathTokens tokens;
+    if (!tokenize_path(path, &tokens))
+        return EINVAL;
+    int result = remove_folder(tree, &tokens);
+    path_tokens_destroy(&tokens);
+    return result;
+}
+
+/* Creates the folder at the path. */
+static int create_folder(Tree *tree, const PathTokens *path) {
+    if (path->depth == 0)
+        return EEXIST;
+
+    ChildRequest request = { .op = JOURNAL_CREATE, .path = path };
+    request_child_change(tree, &request);
+    if (request.result == 0)
+        commit_change(&request.change);
+    return request.result;
+}
+
+int tree_create(Tree *tree, const char *path) {
+    PathTokens tokens;
+    if (!tokenize_path(path, &tokens))
+        return EINVAL;
+    int result = create_folder(tree, &tokens);
+    path_tokens_destroy(&tokens);
+    return result;
+}
+
+/* Counts how many components of the path lead to existing folders, looking them up without
+ * locks. It's only a hint, as folders may be created or removed meanwhile.
+ * Must be called within an epoch critical section. */
+static size_t existing_depth(Tree *tree, const PathTokens *path) {
+    Node *node = tree->root;
+    size_t depth = 0;
+    for (; depth < path->depth; depth++) {
+        load_children(tree, node);
+        node = get_child(node, path, depth);
+        if (!node)
+            break;
+    }
+    return depth;
+}
+
+/* Creates the folders of the path below its first `depth` components, which lead to `parent`,
+ * and gives up write access to `parent`. None of the folders may exist. */
+static void create_missing(Tree *tree, Node *parent, const PathTokens *path, size_t depth) {
+    char name[MAX_FOLDER_NAME_LENGTH + 1];
+
+    /* Nobody can reach the new folders before the shallowest of them is attached, so they're
+     * linked to each other first, the deepest first, with their statistics final. */
+    Node *top = NULL;
+    size_t bytes = 0;
+    for (size_t i = path->depth; i > depth; i--) {
+        Node *node = new_node(tree->pool);
+        if (top) {
+            copy_name(path, i + 1, name);
+            hmap_insert(node->children, name, top);
+            atomic_store(&top->parent, node);
+            atomic_fetch_add(&top->generation, 1);
+        }
+        atomic_store(&node->descendants, path->depth - i);
+        atomic_store(&node->name_bytes, bytes);
+        atomic_store(&node->height, path->depth - i);
+        bytes += path->components[i - 1].length;
+        top = node;
+    }
+
+    Change change;
+    begin_change(tree, &change, JOURNAL_CREATE_ALL, path->path, NULL);
+    change.tokens = path;
+    change.existing = depth;
+    copy_name(path, depth + 1, name);
+    attach_child(&change, parent, name, top);
+    end_change(&change);
+    count_subtree(parent, NULL, path->depth - depth, bytes, false);
+    raise_height(parent, path->depth - depth - 1);
+
+    give_up_write_access(parent);
+    commit_change(&change);
+}
+
+/* Creates the folder at the path together with its missing ancestors. */
+static int create_all(Tree *tree, const PathTokens *path) {
+    for (;;) {
+        epoch_enter();
+        size_t depth = existing_depth(tree, path);
+        epoch_exit();
+
+        if (depth == path->depth) {
+            /* Confirmed with the folder locked, as an ancestor may have been removed meanwhile. */
+            Node *node = lock_folder(tree, path, depth, false);
+            if (!node)
+                continue;
+            give_up_read_access(node);
+            return 0;
+        }
+
+        /* Only the deepest existing folder is locked, and the lookup is repeated if it's been
+         * removed or the next one has been created meanwhile. */
+        Node *parent = lock_folder(tree, path, depth, true);
+        if (!parent)
+            continue;
+        if (get_child(parent, path, depth)) {
+            give_up_write_access(parent);
+            continue;
+        }
+        create_missing(tree, parent, path, depth);
+        return 0;
+    }
+}
+
+int tree_create_all(Tree *tree, const char *path) {
+    PathTokens tokens;
+    if (!tokenize_path(path, &tokens))
+        return EINVAL;
+    int result = create_all(tree, &tokens);
+    path_tokens_destroy(&tokens);
+    return result;
 }
 
 void tree_free(Tree *tree) {
-    remove_nodes(tree->root);
+    if (tree->journal)
+        journal_close(tree->journal);
+
+    /* Buried nodes are still in the pool, so only their graves are freed. */
+    while (tree->graveyard) {
+        Grave *next = tree->graveyard->next;
+        free(tree->graveyard);
+        tree->graveyard = next;
+    }
+    while (tree->snapshots) {
+        Snapshot *next = tree->snapshots->next;
+        free(tree->snapshots);
+        tree->snapshots = next;
+    }
+    if (pthread_mutex_destroy(&tree->snapshots_lock) != 0)
+        syserr("mutex destroy failed");
+    if (pthread_mutex_destroy(&tree->image_lock) != 0)
+        syserr("mutex destroy failed");
+    if (pthread_mutex_destroy(&tree->moves_lock) != 0)
+        syserr("mutex destroy failed");
+    if (pthread_cond_destroy(&tree->moves_cond) != 0)
+        syserr("moves cond destroy failed");
+    for (MoveClaim *claim = atomic_load(&tree->claims); claim;) {
+        MoveClaim *next = claim->next;
+        free(claim);
+        claim = next;
+    }
+
+    /* Nodes removed earlier go back to the pool once retired or reaped,
+     * so that has to happen first. */
+    teardown_free(tree->searchers);
+    teardown_wait(tree->teardown);
+    epoch_barrier();
+    node_pool_free(tree->pool, tree->teardown);
+    teardown_free(tree->teardown);
+    path_cache_free(tree->cache);
+    watchers_free(tree->watchers);
+    if (tree->image)
+        image_close(tree->image);
     free(tree);
 }
 
+void tree_set_lock_policy(TreeLockPolicy policy, bool spin) {
+    node_set_lock_policy(policy, spin);
+}
+
 Tree *tree_new() {
     Tree *tree = (Tree *) malloc(sizeof(Tree));
-    tree->root = new_node();
+    tree->pool = node_pool_new();
+    tree->teardown = teardown_new(0);
+    tree->searchers = teardown_new(0);
+    tree->root = new_node(tree->pool);
+    prefer_readers(tree->root);
+    atomic_init(&tree->clock, 1);
+    atomic_init(&tree->snapshot_count, 0);
+    atomic_init(&tree->oldest_snapshot, ULONG_MAX);
+    if (pthread_mutex_init(&tree->snapshots_lock, 0) != 0)
+        syserr("mutex init failed");
+    tree->snapshots = NULL;
+    tree->graveyard = NULL;
+    tree->image = NULL;
+    tree->journal = NULL;
+    tree->cache = path_cache_new();
+    if (pthread_mutex_init(&tree->image_lock, 0) != 0)
+        syserr("mutex init failed");
+    if (pthread_mutex_init(&tree->moves_lock, 0) != 0)
+        syserr("mutex init failed");
+    if (pthread_cond_init(&tree->moves_cond, 0) != 0)
+        syserr("moves cond init failed");
+    atomic_init(&tree->shared_moves, 0);
+    atomic_init(&tree->exclusive_moves, 0);
+    tree->exclusive_move = false;
+    atomic_init(&tree->claims, NULL);
+    tree->watchers = watchers_new();
     return tree;
 }
 
 char *tree_list(Tree *tree, const char *path) {
-    if (!is_path_valid(path))
+    PathTokens tokens;
+    if (!tokenize_path(path, &tokens))
         return NULL;
 
-    Node *node = read_folder(tree, path);
+    Node *node = lock_folder(tree, &tokens, tokens.depth, false);
+    path_tokens_destroy(&tokens);
 
     if (!node)
         return NULL;
 
-    char *string = make_map_contents_string(node->children);
+    /* Copying the cached listing, so that the caller can free it. */
+    Listing *listing = get_listing(node);
+    char *string = (char *) malloc(listing->length + 1);
+    if (!string)
+        fatal("out of memory");
+    memcpy(string, listing->string, listing->length + 1);
     give_up_read_access(node);
 
     return string;
 }
 
+int tree_list_page(Tree *tree, const char *path, const char *after_name, size_t limit,
+                   TreeListPage *page) {
+    if ((after_name && !is_name_valid(after_name)) || limit == 0)
+        return EINVAL;
+    PathTokens tokens;
+    if (!tokenize_path(path, &tokens))
+        return EINVAL;
+
+    Node *node = lock_folder(tree, &tokens, tokens.depth, false);
+    path_tokens_destroy(&tokens);
+
+    if (!node)
+        return ENOENT;
+
+    /* Only the names on the page are visited, starting from the cursor's position in the index. */
+    ChildIndex *index = get_index(node);
+    ChildIndexCursor cursor = child_index_seek(index, after_name);
+    size_t length;
+    page->names = join_names(index, &cursor, limit, 0, &page->count, &length);
+    page->more = child_index_next(index, &cursor) != NULL;
+    give_up_read_access(node);
+
+    /* The cursor is the last name on the page. */
+    page->cursor = NULL;
+    if (page->more) {
+        char *last_comma = strrchr(page->names, ',');
+        page->cursor = last_comma ? last_comma + 1 : page->names;
+    }
+
+    return 0;
+}
+
+/* A search of `tree_find`, shared by the workers it's split between. */
+typedef struct Search {
+    Tree *tree;
+    const char *pattern;
+    TreeFindCallback callback;
+    void *arg;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond; /* condition for the caller to wait on for the workers */
+    unsigned pending; /* Parts of the search handed over to the workers and not finished yet. */
+} Search;
+
+/* A folder still to be searched, found as a child while its parent was locked. It's locked
+ * again by the pointer, and searched only if it's still the same folder, with the generation
+ * it had then. The node can't be reused meanwhile without that changing. */
+typedef struct SearchItem {
+    Node *node;
+    unsigned long generation;
+    char *path;
+    bool matched; /* Whether the folder itself is a result. */
+} SearchItem;
+
+/* A part of a search handed over to a worker. */
+typedef struct SearchTask {
+    Search *search;
+    SearchItem root;
+} SearchTask;
+
+static void search_subtree(Search *search, SearchItem root);
+
+static void run_search_task(Teardown *teardown, void *arg) {
+    (void) teardown;
+    SearchTask *task = (SearchTask *) arg;
+    Search *search = task->search;
+    SearchItem root = task->root;
+    free(task);
+
+    search_subtree(search, root);
+
+    lock(&search->lock);
+    if (--search->pending == 0 && pthread_cond_signal(&search->done_cond) != 0)
+        syserr("done cond signal failed");
+    unlock(&search->lock);
+}
+
+/* Hands a folder over to one of the search workers of the tree. */
+static void share_search(Search *search, SearchItem item) {
+    SearchTask *task = (SearchTask *) malloc(sizeof(SearchTask));
+    if (!task)
+        fatal("out of memory");
+    task->search = search;
+    task->root = item;
+    task->root.matched = false;
+
+    lock(&search->lock);
+    search->pending++;
+    unlock(&search->lock);
+    teardown_submit(search->tree->searchers, run_search_task, task);
+}
+
+/* Returns the path of the child named `name` of the folder at `path`, or NULL if it would be
+ * longer than a valid path. */
+static char *child_path(const char *path, const char *name) {
+    size_t path_length = strlen(path), name_length = strlen(name);
+    if (path_length + name_length + 1 > MAX_PATH_LENGTH)
+        return NULL;
+    char *result = (char *) malloc(path_length + name_length + 2);
+    if (!result)
+        fatal("out of memory");
+    memcpy(result, path, path_length);
+    memcpy(result + path_length, name, name_length);
+    result[path_length + name_length] = '/';
+    result[path_length + name_length + 1] = '\0';
+    return result;
+}
+
+/* Searches the folders below `root`, reporting those whose names match.
+ * Parts of the subtree still to be searched are handed over to the search workers of the tree
+ * while they're idle. Each folder is locked only while its children are enumerated. */
+static void search_subtree(Search *search, SearchItem root) {
+    size_t capacity = 64, bottom = 0, top = 0;
+    SearchItem *stack = (SearchItem *) malloc(capacity * sizeof(SearchItem));
+    if (!stack)
+        fatal("out of memory");
+    stack[top++] = root;
+
+    while (top > bottom) {
+        /* The bottom of the stack holds the shallowest, so usually the largest, subtrees. */
+        if (top - bottom > 1 && teardown_hungry(search->tree->searchers))
+            share_search(search, stack[bottom++]);
+
+        /* The folder may have been removed or moved since its parent was searched. */
+        SearchItem item = stack[--top];
+        Node *node = item.node;
+        get_read_access(node);
+        if (atomic_load(&node->detaching) || atomic_load(&node->generation) != item.generation) {
+            give_up_read_access(node);
+            free(item.path);
+            continue;
+        }
+        load_children(search->tree, node);
+
+        size_t first_child = top;
+        HashMapIterator it = hmap_iterator(node->children);
+        const char *key;
+        void *value;
+        while (hmap_next(node->children, &it, &key, &value)) {
+            if (top == capacity) {
+                if (bottom > 0) {
+                    memmove(stack, stack + bottom, (top - bottom) * sizeof(SearchItem));
+                    top -= bottom;
+                    first_child -= bottom;
+                    bottom = 0;
+                }
+                else {
+                    capacity *= 2;
+                    stack = (SearchItem *) realloc(stack, capacity * sizeof(SearchItem));
+                    if (!stack)
+                        fatal("out of memory");
+                }
+            }
+            /* The children can't be attached anywhere while the folder is locked. */
+            Node *child_node = (Node *) value;
+            SearchItem child = { child_node, atomic_load(&child_node->generation),
+                                 child_path(item.path, key), fnmatch(search->pattern, key, 0) == 0 };
+            if (child.path)
+                stack[top++] = child;
+        }
+        give_up_read_access(node);
+
+        /* Results are reported once the folder is unlocked. */
+        for (size_t i = first_child; i < top; i++) {
+            if (stack[i].matched)
+                search->callback(stack[i].path, search->arg);
+        }
+        free(item.path);
+    }
+
+    free(stack);
+}
+
+int tree_find(Tree *tree, const char *root_path, const char *pattern, TreeFindCallback callback,
+              void *arg) {
+    PathTokens tokens;
+    if (!pattern || !callback || !tokenize_path(root_path, &tokens))
+        return EINVAL;
+
+    Node *root = lock_folder(tree, &tokens, tokens.depth, false);
+    path_tokens_destroy(&tokens);
+    if (!root)
+        return ENOENT;
+    SearchItem item = { root, atomic_load(&root->generation), strdup(root_path), false };
+    give_up_read_access(root);
+    if (!item.path)
+        fatal("out of memory");
+
+    Search search;
+    search.tree = tree;
+    search.pattern = pattern;
+    search.callback = callback;
+    search.arg = arg;
+    if (pthread_mutex_init(&search.lock, 0) != 0)
+        syserr("mutex init failed");
+    if (pthread_cond_init(&search.done_cond, 0) != 0)
+        syserr("done cond init failed");
+    search.pending = 0;
+
+    search_subtree(&search, item);
+
+    lock(&search.lock);
+    while (search.pending > 0) {
+        if (pthread_cond_wait(&search.done_cond, &search.lock) != 0)
+            syserr("done cond wait failed");
+    }
+    unlock(&search.lock);
+
+    if (pthread_cond_destroy(&search.done_cond) != 0)
+        syserr("done cond destroy failed");
+    if (pthread_mutex_destroy(&search.lock) != 0)
+        syserr("mutex destroy failed");
+    return 0;
+}
+
 /* Checks whether `b` is a subfolder of `a`, considering both paths are valid. */
 bool is_subfolder(const char *a, const char *b) {
     size_t a_length = strlen(a);
@@ -243,116 +1472,458 @@ bool is_subfolder(const char *a, const char *b) {
         return false;
 }
 
-/* Ensures there are no running processes in tree rooted in node. */
-void subtree_wait(Node *node) {
-    get_move_access(node);
-    HashMapIterator it = hmap_iterator(node->children);
-    const char *key;
-    void *value;
-    while (hmap_next(node->children, &it, &key, &value))
-        subtree_wait((Node *) value);
+/* Removes the folder at the path together with its subfolders. */
+static int remove_subtree(Tree *tree, const PathTokens *path) {
+    if (path->depth == 0) /* tried to remove the root */
+        return EBUSY;
+
+    /* Searching for the parent folder and getting a write access to it. */
+    char last_component[MAX_FOLDER_NAME_LENGTH + 1];
+    copy_name(path, path->depth, last_component);
+
+    Node *node = lock_folder(tree, path, path->depth - 1, true);
+
+    if (!node)
+        return ENOENT;
+
+    Node *child = get_child(node, path, path->depth - 1);
+
+    if (!child) {
+        give_up_write_access(node);
+        return ENOENT;
+    }
+
+    /* Like a move, the removal takes the whole subtree out of the tree, so it waits for
+     * the processes in the subtree the same way. */
+    atomic_store(&child->detaching, true);
+    subtree_wait(child);
+
+    Change change;
+    begin_change(tree, &change, JOURNAL_REMOVE_RECURSIVE, path->path, NULL);
+    detach_child(&change, node, last_component);
+    unsigned long time = end_change(&change);
+    count_subtree(node, NULL, atomic_load(&child->descendants) + 1,
+                  atomic_load(&child->name_bytes) + strlen(last_component), true);
+    lower_height(node);
+    give_up_write_access(node);
+
+    bury_subtree(tree, child, time);
+    commit_change(&change);
+    return 0;
 }
 
-/* Finds the last common folder of two given paths.
- * Args:
- * - `path_a`, `path_b`: valid paths
- * - `path`:  longest common subpath of path_a and path_b
- * Returns length of string representation of `path`.
- * Copies the common path of `path_a` and `path_b` and saves it to `path`.
- * The caller should free `path` afterwards. */
-size_t path_lca(const char *path_a, const char *path_b, char **path) {
-    size_t last_dash_index = 0;
-    size_t index = 0;
-    while ((path_a + index)[0] != '\0' && (path_b + index)[0] != '\0') {
-        if (path_a[index] != path_b[index])
+int tree_remove_recursive(Tree *tree, const char *path) {
+    PathTokens tokens;
+    if (!tokenize_path(path, &tokens))
+        return EINVAL;
+    int result = remove_subtree(tree, &tokens);
+    path_tokens_destroy(&tokens);
+    return result;
+}
+
+/* Returns the number of leading components the paths have in common. */
+static size_t common_depth(const PathTokens *a, const PathTokens *b) {
+    size_t depth = 0;
+    for (; depth < a->depth && depth < b->depth; depth++) {
+        const PathComponent *a_component = &a->components[depth];
+        const PathComponent *b_component = &b->components[depth];
+        if (a_component->hash != b_component->hash || a_component->length != b_component->length
+            || memcmp(a->path + a_component->offset, b->path + b_component->offset,
+                      a_component->length) != 0)
             break;
-        if (path_a[index] == '/')
-            last_dash_index = index;
-        index++;
     }
-    char *common_path = (char *) malloc((last_dash_index + 2) * sizeof(char));
-    strncpy(common_path, path_a, last_dash_index + 1);
-    common_path[last_dash_index + 1] = '\0';
-    *path = common_path;
-    return last_dash_index + 1;
+    return depth;
 }
 
-int tree_move(Tree *tree, const char *source, const char *target) {
-    if (!is_path_valid(source) || !is_path_valid(target))
-        return EINVAL;
+/* Waits a while before another attempt to lock both parents of a move. */
+static void move_back_off(int attempt) {
+    if (attempt < MOVE_YIELDS) {
+        sched_yield();
+    }
+    else {
+        long sleep_ns = 1000L << (attempt - MOVE_YIELDS < 10 ? attempt - MOVE_YIELDS : 10);
+        struct timespec pause = { 0, sleep_ns < MOVE_MAX_SLEEP_NS ? sleep_ns : MOVE_MAX_SLEEP_NS };
+        nanosleep(&pause, NULL);
+    }
+}
 
-    if (strcmp(source, "/") == 0)
-        return EBUSY;
+/* Takes a claim of the tree not used by any other move. */
+static MoveClaim *take_claim(Tree *tree) {
+    for (MoveClaim *claim = atomic_load(&tree->claims); claim; claim = claim->next) {
+        bool expected = false;
+        if (!atomic_load(&claim->in_use)
+            && atomic_compare_exchange_strong(&claim->in_use, &expected, true))
+            return claim;
+    }
 
-    if (is_subfolder(source, target)) /* trying to move source to its subtree */
-        return -1;
+    MoveClaim *claim = (MoveClaim *) malloc(sizeof(MoveClaim));
+    if (!claim)
+        fatal("out of memory");
+    atomic_init(&claim->in_use, true);
+    atomic_init(&claim->version, 1);
+    for (int i = 0; i < 3; i++)
+        atomic_init(&claim->nodes[i], NULL);
+    claim->next = atomic_load(&tree->claims);
+    while (!atomic_compare_exchange_weak(&tree->claims, &claim->next, claim))
+        ;
+    return claim;
+}
 
-    /* Locking the lca of source and target to search for source and target
-     * and to not end in deadlock with other process calling `tree_move`. */
-    char *common_path;
-    size_t common_length = path_lca(source, target, &common_path);
-    Node *lca = write_folder(tree->root, common_path, false);
-    free(common_path);
-    if (!lca)
-        return ENOENT;
+/* Withdraws the claim if it's been published, and lets other moves take it. */
+static void release_claim(MoveClaim *claim) {
+    if (atomic_load_explicit(&claim->version, memory_order_relaxed) % 2 == 0)
+        atomic_fetch_add(&claim->version, 1);
+    atomic_store(&claim->in_use, false);
+}
 
-    /* Trying to find and write-lock target's parent. */
-    char new_name[MAX_FOLDER_NAME_LENGTH + 1];
-    char *initial_subpath_target = make_path_to_parent(target + common_length - 1, new_name);
-    const char *target_subpath = initial_subpath_target;
+/* Lets moves waiting to be admitted check again. */
+static void wake_moves(Tree *tree) {
+    lock(&tree->moves_lock);
+    if (pthread_cond_broadcast(&tree->moves_cond) != 0)
+        syserr("moves cond broadcast failed");
+    unlock(&tree->moves_lock);
+}
+
+/* Lets an exclusive move in once the last shared move has unlocked its parents. */
+static void leave_shared_moves(Tree *tree) {
+    /* Pairs with an exclusive move announcing itself before it counts the shared ones. */
+    if (atomic_fetch_sub(&tree->shared_moves, 1) == 1 && atomic_load(&tree->exclusive_moves) > 0)
+        wake_moves(tree);
+}
+
+/* Waits until a move may lock its parents: together with other moves, or, if `exclusive`
+ * is set, as the only one. */
+static void enter_moves(Tree *tree, bool exclusive) {
+    if (!exclusive) {
+        atomic_fetch_add(&tree->shared_moves, 1);
+        if (atomic_load(&tree->exclusive_moves) == 0)
+            return;
+        leave_shared_moves(tree);
+    }
+
+    lock(&tree->moves_lock);
+    if (exclusive) {
+        atomic_fetch_add(&tree->exclusive_moves, 1);
+        while (tree->exclusive_move || atomic_load(&tree->shared_moves) > 0) {
+            if (pthread_cond_wait(&tree->moves_cond, &tree->moves_lock) != 0)
+                syserr("moves cond wait failed");
+        }
+        tree->exclusive_move = true;
+    }
+    else {
+        /* Exclusive moves announce themselves with the mutex held. */
+        while (atomic_load(&tree->exclusive_moves) > 0) {
+            if (pthread_cond_wait(&tree->moves_cond, &tree->moves_lock) != 0)
+                syserr("moves cond wait failed");
+        }
+        atomic_fetch_add(&tree->shared_moves, 1);
+    }
+    unlock(&tree->moves_lock);
+}
+
+/* Lets other moves in once a move has unlocked its parents, releasing its claim if it's taken one. */
+static void leave_moves(Tree *tree, bool exclusive, MoveClaim *claim) {
+    if (claim)
+        release_claim(claim);
+    if (!exclusive) {
+        leave_shared_moves(tree);
+        return;
+    }
+    lock(&tree->moves_lock);
+    tree->exclusive_move = false;
+    atomic_fetch_sub(&tree->exclusive_moves, 1);
+    if (pthread_cond_broadcast(&tree->moves_cond) != 0)
+        syserr("moves cond broadcast failed");
+    unlock(&tree->moves_lock);
+}
+
+/* Reads the nodes of a claim. Returns false if it isn't published. */
+static bool read_claim(MoveClaim *claim, Node **nodes) {
+    for (;;) {
+        unsigned long version = atomic_load(&claim->version);
+        if (version % 2 != 0)
+            return false;
+        for (int i = 0; i < 3; i++)
+            nodes[i] = atomic_load(&claim->nodes[i]);
+        if (atomic_load(&claim->version) == version)
+            return true;
+    }
+}
+
+/* Checks whether `node` is `root` or lies below it. Nodes aren't freed while the tree exists,
+ * so the parents of those another move has let go of may still be followed. A chain that's
+ * too long to be real, as those may be moving, is treated as if it led to `root`. */
+static bool is_below(Node *node, Node *root) {
+    for (size_t depth = 0; node; depth++) {
+        if (node == root || depth > MAX_PATH_DEPTH)
+            return true;
+        node = atomic_load(&node->parent);
+    }
+    return false;
+}
+
+/* Publishes the claim of a move that has locked its parents together with other moves, unless
+ * it conflicts with one published by another move: one of the moves holds a parent in the subtree
+ * the other one waits for. Two such moves could wait for each other. Of two conflicting moves
+ * publishing their claims at the same time, at least one sees the other, as both publish theirs
+ * before they check. Returns whether the claim stays published. */
+static bool claim_move(Tree *tree, MoveClaim *claim, Node *source_node, Node *source_parent,
+                       Node *target_parent) {
+    atomic_store(&claim->nodes[0], source_node);
+    atomic_store(&claim->nodes[1], source_parent);
+    atomic_store(&claim->nodes[2], target_parent);
+    atomic_fetch_add(&claim->version, 1);
+
+    bool conflict = false;
+    for (MoveClaim *other = atomic_load(&tree->claims); other && !conflict; other = other->next) {
+        Node *nodes[3];
+        if (other != claim && read_claim(other, nodes))
+            conflict = is_below(source_parent, nodes[0]) || is_below(target_parent, nodes[0])
+                       || is_below(nodes[1], source_node) || is_below(nodes[2], source_node);
+    }
+
+    if (conflict)
+        atomic_fetch_add(&claim->version, 1);
+    return !conflict;
+}
+
+/* Acquires write access to the folder indicated by the first `depth` components of the path,
+ * with lock coupling from `ancestor`, indicated by the first `from` of them, which the caller
+ * has write access to and keeps. Returns NULL if the folder doesn't exist. */
+static Node *write_below(Tree *tree, Node *ancestor, const PathTokens *path, size_t from,
+                         size_t depth) {
+    Node *node = ancestor;
+    for (size_t i = from; i < depth; i++) {
+        load_children(tree, node);
+        Node *child = get_child(node, path, i);
+        if (child && i + 1 < depth)
+            get_read_access(child);
+        else if (child)
+            get_write_access(child);
+        if (node != ancestor)
+            give_up_read_access(node);
+        if (!child)
+            return NULL;
+        node = child;
+    }
+    load_children(tree, node);
+    return node;
+}
 
-    if (!initial_subpath_target) { /* target is the lca */
-        give_up_write_access(lca);
+/* Tries to lock both parents of a move. Target's parent is locked first, as any folder would be.
+ * Source's parent is then found without locks and only tried to be locked, so that no process
+ * holding it can make us wait while we're holding target's parent. Once both are locked,
+ * `claim` is published, unless source doesn't exist. Returns 0 then, EAGAIN if everything has
+ * been released to be tried again, or ENOENT or EEXIST. */
+static int try_lock_move_parents(Tree *tree, const PathTokens *source, const PathTokens *target,
+                                 bool same_parent, MoveClaim *claim, Node **source_parent,
+                                 Node **target_parent) {
+    *target_parent = lock_folder(tree, target, target->depth - 1, true);
+    if (!*target_parent) /* target's parent doesn't exist */
+        return ENOENT;
+
+    if (get_child(*target_parent, target, target->depth - 1)) { /* target already exists */
+        give_up_write_access(*target_parent);
         return EEXIST;
     }
 
-    Node *target_parent = write_folder(lca, target_subpath, true);
-    free(initial_subpath_target);
+    *source_parent = *target_parent;
+    if (same_parent) {
+        Node *source_node = get_child(*source_parent, source, source->depth - 1);
+        if (!source_node || claim_move(tree, claim, source_node, *source_parent, *target_parent))
+            return 0;
+        give_up_write_access(*target_parent);
+        return EAGAIN;
+    }
 
-    if (!target_parent) { /* target's parent doesn't exist */
-        give_up_write_access(lca);
+    PathTrace trace;
+    trace_init(&trace);
+    epoch_enter();
+    bool found = resolve_path(tree, source, source->depth - 1, *target_parent, &trace,
+                              source_parent);
+    bool locked = found && *source_parent && try_get_write_access(*source_parent);
+    bool valid = locked && validate_path(&trace);
+    epoch_exit();
+    trace_destroy(&trace);
+
+    if (found && !*source_parent) { /* source doesn't exist because its parent doesn't */
+        give_up_write_access(*target_parent);
         return ENOENT;
     }
+    if (valid)
+        load_children(tree, *source_parent);
+    Node *source_node = valid ? get_child(*source_parent, source, source->depth - 1) : NULL;
+    if (!valid
+        || (source_node
+            && !claim_move(tree, claim, source_node, *source_parent, *target_parent))) {
+        if (locked)
+            give_up_write_access(*source_parent);
+        give_up_write_access(*target_parent);
+        return EAGAIN;
+    }
+    return 0;
+}
 
-    if (hmap_get(target_parent->children, new_name)) { /* target already exists */
-        give_up_write_access(lca);
-        if (lca != target_parent)
-            give_up_write_access(target_parent);
+/* Locks both parents of a move, blocking on both, which only the only move in progress may do.
+ * Other processes only ever wait for folders below those they hold, except for moves, which wait
+ * for the processes in the moved subtree while they hold target's parent. So a parent that is
+ * an ancestor of the other one is locked first, and the other one is found below it with lock
+ * coupling. Otherwise, target's parent is locked first, and source's parent is found without locks
+ * and waited for. Returns 0 once both are locked, or ENOENT or EEXIST. */
+static int lock_move_parents(Tree *tree, const PathTokens *source, const PathTokens *target,
+                             size_t common, Node **source_parent, Node **target_parent) {
+    if (source->depth - 1 == common) {
+        *source_parent = lock_folder(tree, source, common, true);
+        if (!*source_parent)
+            return ENOENT;
+        *target_parent = write_below(tree, *source_parent, target, common, target->depth - 1);
+        if (!*target_parent) {
+            give_up_write_access(*source_parent);
+            return ENOENT;
+        }
+    }
+    else if (target->depth - 1 == common) {
+        *target_parent = lock_folder(tree, target, common, true);
+        if (!*target_parent)
+            return ENOENT;
+        *source_parent = write_below(tree, *target_parent, source, common, source->depth - 1);
+        if (!*source_parent) {
+            give_up_write_access(*target_parent);
+            return ENOENT;
+        }
+    }
+    else {
+        *target_parent = lock_folder(tree, target, target->depth - 1, true);
+        if (!*target_parent)
+            return ENOENT;
+
+        PathTrace trace;
+        trace_init(&trace);
+        bool found = false, valid = false;
+        while (!valid) {
+            trace.depth = 0;
+            epoch_enter();
+            found = resolve_path(tree, source, source->depth - 1, *target_parent, &trace,
+                                 source_parent);
+            if (found && *source_parent) {
+                get_write_access(*source_parent);
+                valid = validate_path(&trace);
+                if (!valid)
+                    give_up_write_access(*source_parent);
+            }
+            epoch_exit();
+            if (found && !*source_parent)
+                break;
+        }
+        trace_destroy(&trace);
+
+        if (!valid) { /* source doesn't exist because its parent doesn't */
+            give_up_write_access(*target_parent);
+            return ENOENT;
+        }
+        load_children(tree, *source_parent);
+    }
+
+    if (get_child(*target_parent, target, target->depth - 1)) { /* target already exists */
+        give_up_write_access(*source_parent);
+        if (*source_parent != *target_parent)
+            give_up_write_access(*target_parent);
         return EEXIST;
     }
+    return 0;
+}
 
-    /* Trying to find and lock source's parent, as we are planning to modify its hashmap. */
-    char source_name[MAX_FOLDER_NAME_LENGTH + 1];
-    char *initial_subpath_source = make_path_to_parent(source + common_length - 1, source_name);
-    const char *source_subpath = initial_subpath_source;
+/* Moves the folder at `source` to `target`. */
+static int move_folder(Tree *tree, const PathTokens *source, const PathTokens *target) {
+    if (source->depth == 0)
+        return EBUSY;
 
-    Node *source_parent = write_folder(lca, source_subpath, true);
-    free(initial_subpath_source);
+    if (is_subfolder(source->path, target->path)) /* trying to move source to its subtree */
+        return -1;
 
-    /* Source's parent and target's parent have been locked, so we're unlocking the lca. */
-    if (lca != target_parent && lca != source_parent)
-        give_up_write_access(lca);
+    size_t common = common_depth(source, target);
 
-    if (!source_parent) { /* source doesn't exist because its parent doesn't */
-        give_up_write_access(target_parent);
-        return ENOENT;
+    if (target->depth == common) { /* target is the lca of source and target */
+        Node *lca = lock_folder(tree, target, common, false);
+        if (!lca)
+            return ENOENT;
+        give_up_read_access(lca);
+        return EEXIST;
     }
 
-    Node *source_node = hmap_get(source_parent->children, source_name);
+    char new_name[MAX_FOLDER_NAME_LENGTH + 1];
+    copy_name(target, target->depth, new_name);
+    char source_name[MAX_FOLDER_NAME_LENGTH + 1];
+    copy_name(source, source->depth, source_name);
+    bool same_parent = source->depth == target->depth && common + 1 == source->depth;
+
+    /* Instead of locking the lca, which would serialize all moves below it, both parents are
+     * locked on their own. A move that keeps failing to do so waits to be the only one. */
+    Node *target_parent, *source_parent;
+    MoveClaim *claim = take_claim(tree);
+    bool exclusive = false;
+    enter_moves(tree, exclusive);
+    int result = EAGAIN;
+    for (int attempt = 0; attempt < MOVE_ATTEMPTS && result == EAGAIN; attempt++) {
+        if (attempt > 0)
+            move_back_off(attempt - 1);
+        result = try_lock_move_parents(tree, source, target, same_parent, claim, &source_parent,
+                                       &target_parent);
+    }
+    if (result == EAGAIN) {
+        leave_moves(tree, exclusive, claim);
+        claim = NULL;
+        exclusive = true;
+        enter_moves(tree, exclusive);
+        result = lock_move_parents(tree, source, target, common, &source_parent, &target_parent);
+    }
+    if (result != 0) {
+        leave_moves(tree, exclusive, claim);
+        return result;
+    }
 
+    Node *source_node = get_child(source_parent, source, source->depth - 1);
     if (!source_node) { /* source doesn't exist */
         give_up_write_access(source_parent);
         if (source_parent != target_parent)
             give_up_write_access(target_parent);
+        leave_moves(tree, exclusive, claim);
         return ENOENT;
     }
 
-    /* Waiting for processes in source's subtree to finish. */
+    size_t source_levels = source->depth - 1 - common;
+
+    /* Waiting for processes in source's subtree to finish. Processes that reach it
+     * without locking the parents from now on will see the move and back off. */
+    atomic_store(&source_node->detaching, true);
     subtree_wait(source_node);
 
-    /* Actually moving the subtree. */
-    hmap_remove(source_parent->children, source_name);
-    hmap_insert(target_parent->children, new_name, source_node);
+    /* Actually moving the subtree, as a single change. */
+    Change change;
+    begin_change(tree, &change, JOURNAL_MOVE, source->path, target->path);
+    detach_child(&change, source_parent, source_name);
+    attach_child(&change, target_parent, new_name, source_node);
+    end_change(&change);
+
+    /* The common ancestors of both parents keep their statistics, except for the length of
+     * the moved folder's name, and the height, which is raised along with the target's
+     * ancestors before it's recomputed. */
+    Node *lca = source_parent;
+    for (size_t i = 0; i < source_levels; i++)
+        lca = atomic_load(&lca->parent);
+    size_t folders = atomic_load(&source_node->descendants) + 1;
+    size_t source_length = strlen(source_name), new_length = strlen(new_name);
+    count_subtree(source_parent, lca, folders,
+                  atomic_load(&source_node->name_bytes) + source_length, true);
+    count_subtree(target_parent, lca, folders,
+                  atomic_load(&source_node->name_bytes) + new_length, false);
+    if (new_length != source_length)
+        count_subtree(lca, NULL, 0, new_length > source_length ? new_length - source_length
+                                                                : source_length - new_length,
+                      new_length < source_length);
+    raise_height(target_parent, atomic_load(&source_node->height));
+    lower_height(source_parent);
+    atomic_store(&source_node->detaching, false);
 
     /* Unlocking both parents. We don't need to unlock the moved node,
      * since no other process is working on its subtree and any new incoming process
@@ -360,6 +1931,577 @@ int tree_move(Tree *tree, const char *source, const char *target) {
     give_up_write_access(target_parent);
     if (target_parent != source_parent)
         give_up_write_access(source_parent);
+    leave_moves(tree, exclusive, claim);
+
+    commit_change(&change);
+    return 0;
+}
+
+int tree_move(Tree *tree, const char *source, const char *target) {
+    PathTokens source_tokens, target_tokens;
+    if (!tokenize_path(source, &source_tokens))
+        return EINVAL;
+    if (!tokenize_path(target, &target_tokens)) {
+        path_tokens_destroy(&source_tokens);
+        return EINVAL;
+    }
+    int result = move_folder(tree, &source_tokens, &target_tokens);
+    path_tokens_destroy(&source_tokens);
+    path_tokens_destroy(&target_tokens);
+    return result;
+}
+
+/* An operation of a batch, sorted by the path of its parent within its segment. */
+typedef struct BatchEntry {
+    const char *path;
+    size_t parent_length; /* Of the prefix of `path` that names its parent. */
+    size_t index; /* Of the operation in the batch. */
+} BatchEntry;
+
+/* A folder removed by a batch, to be buried once its parent is unlocked. */
+typedef struct BatchGrave {
+    Node *node;
+    unsigned long time;
+} BatchGrave;
+
+/* What a batch keeps from one group of operations with the same parent to the next.
+ * Groups are only formed within a segment of consecutive operations, none of whose paths
+ * is below another one's, so that reordering them can't change their results. */
+typedef struct Batch {
+    Tree *tree;
+    const TreeOp *ops;
+    int *results;
+    PathTokens tokens[2];
+    int last; /* Index in `tokens` of the path whose parent was locked last, or -1. */
+    PathTrace trace; /* The folders on the path to that parent. */
+    BatchGrave *graves;
+    size_t grave_count;
+    size_t grave_capacity;
+    HashMap *paths; /* Of the operations of the current segment. */
+    HashMap *ancestors; /* Of those paths, other than the root. */
+} Batch;
+
+/* Returns the length of the prefix of a valid path, other than the root, that names its parent. */
+static size_t parent_length(const char *path) {
+    size_t length = strlen(path);
+    if (length < 2)
+        return length;
+    size_t i = length - 2;
+    while (i > 0 && path[i] != '/')
+        i--;
+    return i + 1;
+}
+
+/* Orders operations by the paths of their parents, so that parents with long common prefixes
+ * are next to each other, and then by their order in the batch. */
+static int compare_batch_entries(const void *a, const void *b) {
+    const BatchEntry *x = (const BatchEntry *) a, *y = (const BatchEntry *) b;
+    size_t length = x->parent_length < y->parent_length ? x->parent_length : y->parent_length;
+    int order = memcmp(x->path, y->path, length);
+    if (order != 0)
+        return order;
+    if (x->parent_length != y->parent_length)
+        return x->parent_length < y->parent_length ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/* Acquires write access to the parent of the folder at the path, resolving the path without
+ * locks after the first `shared` folders of `trace`, which it has in common with the path
+ * resolved before. Leaves the folders on the path to the parent in `trace`.
+ * Returns NULL if the parent doesn't exist. */
+static Node *lock_batch_parent(Tree *tree, const PathTokens *path, PathTrace *trace, size_t shared) {
+    size_t depth = path->depth - 1;
+    Node *node = NULL;
+    bool done = false;
+
+    epoch_enter();
+    /* The shared folders have been found outside of this critical section, so they're only
+     * known not to be reclaimed while it lasts if they're still in place. */
+    if (trace->depth > shared)
+        trace->depth = shared;
+    if (!validate_path(trace))
+        trace->depth = 0;
+
+    for (int attempt = 0; attempt < OPTIMISTIC_ATTEMPTS && !done; attempt++) {
+        if (resolve_path(tree, path, depth, NULL, trace, &node)) {
+            done = true;
+            if (node) {
+                get_write_access(node);
+                done = validate_path(trace);
+                if (!done)
+                    give_up_write_access(node);
+            }
+        }
+        if (!done)
+            trace->depth = 0;
+    }
+    epoch_exit();
+
+    if (!done)
+        return lock_folder(tree, path, depth, true);
+    if (node)
+        load_children(tree, node);
+    return node;
+}
+
+/* Applies `count` operations of a batch with the same parent under a single acquisition of
+ * write access to it. Returns how many have succeeded. */
+static size_t apply_batch_group(Batch *batch, const BatchEntry *entries, size_t count) {
+    Tree *tree = batch->tree;
+
+    /* The first valid path of the group leads to the parent. */
+    int slot = batch->last == 0 ? 1 : 0;
+    PathTokens *path = &batch->tokens[slot];
+    size_t first = 0;
+    for (; first < count && !tokenize_path(entries[first].path, path); first++)
+        batch->results[entries[first].index] = EINVAL;
+    if (first == count)
+        return 0;
+
+    size_t shared = 0;
+    if (batch->last >= 0) {
+        const PathTokens *previous = &batch->tokens[batch->last];
+        shared = common_depth(previous, path);
+        if (shared > previous->depth - 1)
+            shared = previous->depth - 1;
+        if (shared > path->depth - 1)
+            shared = path->depth - 1;
+        path_tokens_destroy(&batch->tokens[batch->last]);
+    }
+    batch->last = slot;
+
+    Node *parent = lock_batch_parent(tree, path, &batch->trace, shared);
+    if (!parent) {
+        for (size_t i = first; i < count; i++)
+            batch->results[entries[i].index] = is_path_valid(entries[i].path) ? ENOENT : EINVAL;
+        return 0;
+    }
+
+    Change change;
+    bool changed = false;
+    size_t succeeded = 0, created = 0, created_bytes = 0, removed = 0, removed_bytes = 0;
+    batch->grave_count = 0;
+    for (size_t i = first; i < count; i++) {
+        int *result = &batch->results[entries[i].index];
+        PathTokens own;
+        const PathTokens *op_path = path;
+        if (i != first) {
+            if (!tokenize_path(entries[i].path, &own)) {
+                *result = EINVAL;
+                continue;
+            }
+            op_path = &own;
+        }
+        size_t name_length = op_path->components[op_path->depth - 1].length;
+
+        Change op_change;
+        if (batch->ops[entries[i].index].kind == TREE_OP_CREATE) {
+            *result = create_child(tree, parent, op_path, &op_change);
+            if (*result == 0) {
+                created++;
+                created_bytes += name_length;
+            }
+        }
+        else {
+            Node *child;
+            unsigned long time;
+            *result = remove_child(tree, parent, op_path, &op_change, &child, &time);
+            if (*result == 0) {
+                if (batch->grave_count == batch->grave_capacity) {
+                    batch->grave_capacity = batch->grave_capacity ? 2 * batch->grave_capacity : 16;
+                    batch->graves = (BatchGrave *) realloc(batch->graves,
+                                                           batch->grave_capacity * sizeof(BatchGrave));
+                    if (!batch->graves)
+                        fatal("out of memory");
+                }
+                batch->graves[batch->grave_count++] = (BatchGrave) { child, time };
+                removed++;
+                removed_bytes += name_length;
+            }
+        }
+        if (*result == 0) {
+            change = op_change;
+            changed = true;
+            succeeded++;
+        }
+        if (i != first)
+            path_tokens_destroy(&own);
+    }
+
+    /* The statistics are updated once for the whole group. */
+    count_children(parent, created, created_bytes, removed, removed_bytes);
+    give_up_write_access(parent);
+
+    for (size_t i = 0; i < batch->grave_count; i++)
+        bury_subtree(tree, batch->graves[i].node, batch->graves[i].time);
+    /* Journaled changes become durable in order, so it's enough to wait for the last one. */
+    if (changed)
+        commit_change(&change);
+    return succeeded;
+}
+
+/* Checks whether the operation on the valid path may affect, or be affected by, one of
+ * the current segment: one of their paths is below the other one. */
+static bool depends_on_segment(const Batch *batch, const char *path) {
+    size_t length = strlen(path);
+    if (hmap_get(batch->ancestors, path))
+        return true;
+    for (size_t i = 1; i + 1 < length; i++) {
+        if (path[i] == '/' && hmap_get_hashed(batch->paths, path, i + 1, hmap_hash(path, i + 1)))
+            return true;
+    }
+    return false;
+}
+
+/* Adds the operation on the valid path to the current segment. */
+static void add_to_segment(Batch *batch, const char *path) {
+    char prefix[MAX_PATH_LENGTH + 1];
+    size_t length = strlen(path);
+    hmap_insert(batch->paths, path, (void *) path);
+    for (size_t i = 1; i + 1 < length; i++) {
+        if (path[i] == '/') {
+            memcpy(prefix, path, i + 1);
+            prefix[i + 1] = '\0';
+            hmap_insert(batch->ancestors, prefix, (void *) path);
+        }
+    }
+}
+
+/* Applies a segment of `count` operations of a batch, grouped by parent. Returns how many
+ * have succeeded. */
+static size_t apply_batch_segment(Batch *batch, BatchEntry *entries, size_t count) {
+    qsort(entries, count, sizeof(BatchEntry), compare_batch_entries);
+
+    size_t succeeded = 0;
+    for (size_t start = 0, end; start < count; start = end) {
+        for (end = start + 1; end < count; end++) {
+            if (entries[end].parent_length != entries[start].parent_length
+                || memcmp(entries[end].path, entries[start].path, entries[start].parent_length) != 0)
+                break;
+        }
+        succeeded += apply_batch_group(batch, entries + start, end - start);
+    }
+    hmap_clear(batch->paths);
+    hmap_clear(batch->ancestors);
+    return succeeded;
+}
+
+size_t tree_apply_batch(Tree *tree, const TreeOp *ops, size_t n, int *results) {
+    if (n == 0)
+        return 0;
+    BatchEntry *entries = (BatchEntry *) malloc(n * sizeof(BatchEntry));
+    if (!entries)
+        fatal("out of memory");
+
+    Batch batch;
+    batch.tree = tree;
+    batch.ops = ops;
+    batch.results = results;
+    batch.last = -1;
+    trace_init(&batch.trace);
+    batch.graves = NULL;
+    batch.grave_count = 0;
+    batch.grave_capacity = 0;
+    batch.paths = hmap_new();
+    batch.ancestors = hmap_new();
+    if (!batch.paths || !batch.ancestors)
+        fatal("out of memory");
+
+    /* A segment ends before the first operation that depends on one of it. */
+    size_t count = 0, segment = 0, succeeded = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (ops[i].kind != TREE_OP_CREATE && ops[i].kind != TREE_OP_REMOVE) {
+            results[i] = EINVAL;
+            continue;
+        }
+        if (!is_path_valid(ops[i].path)) {
+            results[i] = EINVAL;
+            continue;
+        }
+        if (strcmp(ops[i].path, "/") == 0) { /* the root has no parent to lock */
+            results[i] = ops[i].kind == TREE_OP_CREATE ? EEXIST : EBUSY;
+            continue;
+        }
+        if (depends_on_segment(&batch, ops[i].path)) {
+            succeeded += apply_batch_segment(&batch, entries + segment, count - segment);
+            segment = count;
+        }
+        add_to_segment(&batch, ops[i].path);
+        entries[count++] = (BatchEntry) { ops[i].path, parent_length(ops[i].path), i };
+    }
+    succeeded += apply_batch_segment(&batch, entries + segment, count - segment);
+
+    if (batch.last >= 0)
+        path_tokens_destroy(&batch.tokens[batch.last]);
+    trace_destroy(&batch.trace);
+    free(batch.graves);
+    hmap_free(batch.paths);
+    hmap_free(batch.ancestors);
+    free(entries);
+    return succeeded;
+}
+
+Snapshot *tree_snapshot(Tree *tree) {
+    Snapshot *snapshot = (Snapshot *) malloc(sizeof(Snapshot));
+    if (!snapshot)
+        fatal("out of memory");
+    snapshot->tree = tree;
+
+    /* The snapshot is registered right away with a time no later than its own,
+     * so that nothing it may need is dropped in the meantime. */
+    lock(&tree->snapshots_lock);
+    snapshot->time = atomic_load(&tree->clock);
+    snapshot->prev = NULL;
+    snapshot->next = tree->snapshots;
+    if (tree->snapshots)
+        tree->snapshots->prev = snapshot;
+    tree->snapshots = snapshot;
+    if (snapshot->time < atomic_load(&tree->oldest_snapshot))
+        atomic_store(&tree->oldest_snapshot, snapshot->time);
+    atomic_fetch_add(&tree->snapshot_count, 1);
+    unlock(&tree->snapshots_lock);
+
+    /* Waiting for the changes that haven't been recorded, so that every change made after
+     * the snapshot's time is. Then waiting for the changes made before that time to finish,
+     * so that readers of the snapshot see their effects. */
+    epoch_synchronize();
+    unsigned long time = atomic_fetch_add(&tree->clock, 1);
+    epoch_synchronize();
+
+    lock(&tree->snapshots_lock);
+    snapshot->time = time;
+    unlock(&tree->snapshots_lock);
+    return snapshot;
+}
+
+char *snapshot_list(Snapshot *snapshot, const char *path) {
+    if (!is_path_valid(path))
+        return NULL;
+
+    char component[MAX_FOLDER_NAME_LENGTH + 1];
+    const char *subpath = path;
+    Node *node = snapshot->tree->root;
+    char *string = NULL;
+
+    /* Nodes are found and listed as they were, without locking them. */
+    epoch_enter();
+    while (node && (subpath = split_path(subpath, component))) {
+        load_children(snapshot->tree, node);
+        node = history_get(node, component, snapshot->time);
+    }
+    if (node) {
+        load_children(snapshot->tree, node);
+        string = history_list(node, snapshot->time);
+    }
+    epoch_exit();
+
+    return string;
+}
+
+void snapshot_release(Snapshot *snapshot) {
+    Tree *tree = snapshot->tree;
+
+    lock(&tree->snapshots_lock);
+    if (snapshot->prev)
+        snapshot->prev->next = snapshot->next;
+    else
+        tree->snapshots = snapshot->next;
+    if (snapshot->next)
+        snapshot->next->prev = snapshot->prev;
+    atomic_fetch_sub(&tree->snapshot_count, 1);
+
+    unsigned long oldest = ULONG_MAX;
+    for (Snapshot *other = tree->snapshots; other; other = other->next) {
+        if (other->time < oldest)
+            oldest = other->time;
+    }
+    atomic_store(&tree->oldest_snapshot, oldest);
+
+    /* Folders removed before the oldest snapshot left can't be seen anymore. */
+    Grave *freed = NULL;
+    for (Grave **link = &tree->graveyard; *link;) {
+        Grave *grave = *link;
+        if (grave->time < oldest) {
+            *link = grave->next;
+            grave->next = freed;
+            freed = grave;
+        }
+        else {
+            link = &grave->next;
+        }
+    }
+    unlock(&tree->snapshots_lock);
+
+    while (freed) {
+        Grave *next = freed->next;
+        dispose_subtree(tree, freed->node);
+        free(freed);
+        freed = next;
+    }
+    free(snapshot);
+}
+
+/* Writes an image of the tree as seen by the snapshot to `fd`. */
+static int save_snapshot(void *arg, int fd) {
+    Snapshot *snapshot = (Snapshot *) arg;
+    Tree *tree = snapshot->tree;
+    ImageBuilder *builder = image_builder_new();
+
+    /* Folders are visited in breadth-first order, the order of the image. */
+    size_t capacity = 64, head = 0, tail = 0;
+    Node **queue = (Node **) malloc(capacity * sizeof(Node *));
+    if (!queue)
+        fatal("out of memory");
+    queue[tail++] = tree->root;
+
+    while (head < tail) {
+        Node *node = queue[head++];
+        load_children(tree, node);
+        epoch_enter();
+        HashMap *children = history_children(node, snapshot->time);
+        epoch_exit();
+
+        /* The children are kept alive by the snapshot. */
+        const char **names = make_map_contents_array(children);
+        size_t count = hmap_size(children);
+        image_builder_add_children(builder, names, count);
+        for (size_t i = 0; i < count; i++) {
+            if (tail == capacity) {
+                memmove(queue, queue + head, (tail - head) * sizeof(Node *));
+                tail -= head;
+                head = 0;
+                if (tail == capacity) {
+                    capacity *= 2;
+                    queue = (Node **) realloc(queue, capacity * sizeof(Node *));
+                    if (!queue)
+                        fatal("out of memory");
+                }
+            }
+            queue[tail++] = (Node *) hmap_get(children, names[i]);
+        }
+        free(names);
+        hmap_free(children);
+    }
+    free(queue);
+
+    int result = image_builder_write(builder, snapshot->time, fd);
+    image_builder_free(builder);
+    return result;
+}
+
+int tree_stat(Tree *tree, const char *path, TreeStats *stats) {
+    PathTokens tokens;
+    if (!tokenize_path(path, &tokens))
+        return EINVAL;
+
+    Node *node = lock_folder(tree, &tokens, tokens.depth, false);
+    path_tokens_destroy(&tokens);
+
+    if (!node)
+        return ENOENT;
+
+    stats->descendants = atomic_load(&node->descendants);
+    stats->name_bytes = atomic_load(&node->name_bytes);
+    stats->max_depth = atomic_load(&node->height);
+    give_up_read_access(node);
 
     return 0;
-}
\ No newline at end of file
+}
+
+int tree_save(Tree *tree, int fd) {
+    /* The tree is saved as it was at a single moment, without stopping the changes. */
+    Snapshot *snapshot = tree_snapshot(tree);
+    int result = save_snapshot(snapshot, fd);
+    snapshot_release(snapshot);
+    return result;
+}
+
+Tree *tree_load_mmap(const char *path) {
+    TreeImage *image = image_open(path);
+    if (!image)
+        return NULL;
+
+    /* Only the root is created, the other folders are created once they're reached. */
+    Tree *tree = tree_new();
+    tree->image = image;
+    const ImageNode *root = image_root(image);
+    atomic_store(&tree->root->image, root->child_count > 0 ? root : NULL);
+    atomic_store(&tree->root->descendants, root->descendants);
+    atomic_store(&tree->root->name_bytes, root->name_bytes);
+    atomic_store(&tree->root->height, root->max_depth);
+    if (image_time(image) >= atomic_load(&tree->clock))
+        atomic_store(&tree->clock, image_time(image) + 1);
+    return tree;
+}
+
+/* Applies a change read back from the journal. */
+static void replay_change(void *arg, const JournalEntry *entry) {
+    Tree *tree = (Tree *) arg;
+    switch (entry->op) {
+        case JOURNAL_CREATE:
+            tree_create(tree, entry->path);
+            break;
+        case JOURNAL_REMOVE:
+            tree_remove(tree, entry->path);
+            break;
+        case JOURNAL_REMOVE_RECURSIVE:
+            tree_remove_recursive(tree, entry->path);
+            break;
+        case JOURNAL_MOVE:
+            tree_move(tree, entry->path, entry->target);
+            break;
+        case JOURNAL_CREATE_ALL:
+            tree_create_all(tree, entry->path);
+            break;
+    }
+}
+
+Tree *tree_open(const char *image_path, const char *journal_path) {
+    Tree *tree = NULL;
+    if (image_path) {
+        tree = tree_load_mmap(image_path);
+        if (!tree && errno != ENOENT)
+            return NULL;
+    }
+    if (!tree)
+        tree = tree_new();
+
+    /* The changes saved in the image are skipped. The journal is attached only afterwards,
+     * so that the replayed changes aren't journaled again. */
+    unsigned long after = tree->image ? image_time(tree->image) : 0, last;
+    Journal *journal = journal_open(journal_path, after, replay_change, tree, &last);
+    if (!journal) {
+        int error = errno;
+        tree_free(tree);
+        errno = error;
+        return NULL;
+    }
+    tree->journal = journal;
+    if (last >= atomic_load(&tree->clock))
+        atomic_store(&tree->clock, last + 1);
+    return tree;
+}
+
+int tree_compact(Tree *tree, const char *image_path) {
+    if (!tree->journal)
+        return EINVAL;
+
+    Snapshot *snapshot = tree_snapshot(tree);
+    int result = journal_compact(tree->journal, image_path, snapshot->time, save_snapshot, snapshot);
+    snapshot_release(snapshot);
+    return result;
+}
+
+TreeWatch *tree_watch(Tree *tree, const char *path) {
+    if (!is_path_valid(path))
+        return NULL;
+    return watchers_add(tree->watchers, path);
+}
+
+TreeEvent *tree_watch_next(TreeWatch *watch) {
+    return watch_next(watch);
+}
+
+void tree_unwatch(TreeWatch *watch) {
+    watchers_remove(watch);
+}
@@ -1,4 +1,6 @@
 #pragma once
+#include <stdbool.h>
+#include <stddef.h>
 
 typedef struct Tree Tree; // Let "Tree" mean the same as "struct Tree".
 
@@ -6,10 +8,179 @@ Tree* tree_new();
 
 void tree_free(Tree*);
 
+// The order in which processes waiting for a folder get access to it.
+typedef enum TreeLockPolicy {
+    // Readers queue up behind waiting writers, and a leaving writer hands the folder over to
+    // the waiting readers, which readers arriving in the meantime may join. The default.
+    TREE_LOCK_HANDOFF,
+    // Like TREE_LOCK_HANDOFF, but only the readers that were waiting when the writer left
+    // are let in, so that a writer never waits for more than one phase of readers.
+    TREE_LOCK_PHASE_FAIR,
+    // Waiting writers always go before waiting readers.
+    TREE_LOCK_WRITERS_FIRST,
+} TreeLockPolicy;
+
+// Select the lock policy of all trees, and whether processes waiting for a folder spin for
+// a while before they block, which they never do on a single CPU. Spinning is on by default.
+// Must be called before any tree is created.
+void tree_set_lock_policy(TreeLockPolicy policy, bool spin);
+
 char* tree_list(Tree* tree, const char* path);
 
+// A slice of the sorted contents of a folder, as returned by `tree_list_page`.
+typedef struct TreeListPage {
+    char* names; // Comma-separated, sorted names. The caller should free it.
+    size_t count; // Number of names in `names`.
+    bool more; // Whether the folder had more names after this page.
+    // If `more` is set, the last name in `names` (pointing into it), to be passed as
+    // `after_name` to get the next page. NULL otherwise.
+    const char* cursor;
+} TreeListPage;
+
+// Fill `page` with at most `limit` names of the folder's children that come after
+// `after_name` (or from the first one if it's NULL), in sorted order.
+// Returns 0, EINVAL for an invalid path, name or zero limit, or ENOENT if the folder doesn't exist.
+// Pages of a folder that is modified in the meantime reflect each modification at most once:
+// names are never repeated, but a name created before the cursor is skipped.
+int tree_list_page(Tree* tree, const char* path, const char* after_name, size_t limit,
+                   TreeListPage* page);
+
 int tree_create(Tree* tree, const char* path);
 
+// Create the folder together with all its missing ancestors, like `mkdir -p`.
+// The path is resolved once, only the deepest existing folder is locked for writing, and the
+// missing folders are linked into the tree at once, as a single change.
+// Watches see a TREE_EVENT_CREATE for every folder created, the shallowest first.
+// Returns 0, also if the folder exists already, or EINVAL for an invalid path.
+int tree_create_all(Tree* tree, const char* path);
+
 int tree_remove(Tree* tree, const char* path);
 
+// Remove the folder together with all its subfolders.
+// Returns the same errors as `tree_remove`, except for ENOTEMPTY.
+// The subtree is freed in the background, by the tree's worker threads.
+int tree_remove_recursive(Tree* tree, const char* path);
+
 int tree_move(Tree* tree, const char* source, const char* target);
+
+typedef enum TreeOpKind {
+    TREE_OP_CREATE,
+    TREE_OP_REMOVE,
+} TreeOpKind;
+
+// An operation of `tree_apply_batch`.
+typedef struct TreeOp {
+    TreeOpKind kind;
+    const char* path;
+} TreeOp;
+
+// Apply `n` creations and removals, setting `results[i]` to what `tree_create` or `tree_remove`
+// would return for `ops[i]` if they were called one by one in the order of the batch.
+// Operations that can't affect each other, none of whose paths is below another one's, are
+// grouped by parent: every parent is locked once for all of its operations, and the common
+// prefixes of the paths of the parents are resolved once. An operation is never applied before
+// an earlier one on a folder above or below it, nor after a later one.
+// Each operation is a change of its own, so other processes may see some of them done and
+// others not. Returns how many operations have succeeded.
+size_t tree_apply_batch(Tree* tree, const TreeOp* ops, size_t n, int* results);
+
+// Called by `tree_find` with the path of every folder found.
+typedef void (*TreeFindCallback)(const char* path, void* arg);
+
+// Call `callback(path, arg)` for every folder below the one at `root_path` whose name matches
+// the shell wildcard `pattern`, as in fnmatch(3), so that "abc*" finds names with a prefix.
+// The subtree is searched in parallel by the tree's worker threads, each folder locked only while
+// its children are enumerated, so the callback may be called from several threads at once,
+// in no particular order. Folders changed during the search may or may not be found, at either
+// their old or their new path. Folders whose paths would be longer than MAX_PATH_LENGTH
+// aren't searched.
+// Returns 0 once the search is over, EINVAL for an invalid path, or ENOENT if the folder
+// doesn't exist.
+int tree_find(Tree* tree, const char* root_path, const char* pattern, TreeFindCallback callback,
+              void* arg);
+
+// Statistics of the subtree below a folder, as returned by `tree_stat`.
+typedef struct TreeStats {
+    size_t descendants; // Number of folders below the folder.
+    size_t max_depth; // Depth of the deepest of them, relative to the folder, 0 if there are none.
+    size_t name_bytes; // Total length of their names.
+} TreeStats;
+
+// Fill `stats` with the statistics of the folder's subtree, which are kept up to date by
+// the changes of the tree, so that this takes time proportional only to the depth of the path.
+// Returns 0, EINVAL for an invalid path, or ENOENT if the folder doesn't exist.
+// While changes below the folder are in progress, the statistics may not reflect all of them yet.
+int tree_stat(Tree* tree, const char* path, TreeStats* stats);
+
+// A consistent, read-only view of the whole tree at the moment it was taken.
+typedef struct Snapshot Snapshot;
+
+// Take a snapshot of the tree. Takes time proportional to the number of threads
+// using the tree, not to its size. Changes made while snapshots exist are recorded,
+// and removed folders are kept until the snapshots that can see them are released.
+Snapshot* tree_snapshot(Tree* tree);
+
+// Like `tree_list`, but lists the folder as it was when the snapshot was taken.
+// Takes no locks, so it neither waits for nor slows down the changes of the tree.
+char* snapshot_list(Snapshot* snapshot, const char* path);
+
+// Release a snapshot. Snapshots that are still held when their tree is freed are freed with it.
+void snapshot_release(Snapshot* snapshot);
+
+// Write an image of the tree, as it was at a single moment, to `fd`.
+// Returns 0, or an errno value if writing fails.
+int tree_save(Tree* tree, int fd);
+
+// Create a tree from the image saved by `tree_save` in the file at `path`.
+// The file is mapped into memory and checked once, and folders are created from it only
+// once they're reached.
+// Returns NULL and sets errno if the file can't be mapped or isn't a valid image.
+Tree* tree_load_mmap(const char* path);
+
+// Open a tree that journals its changes: load it from the image at `image_path`, unless
+// it's NULL or there's no such file, and replay the changes in the journal at `journal_path`,
+// creating it if needed. Successful creations, removals and moves are then appended to the
+// journal, and return once they're durable. Concurrent changes are synced together.
+// Returns NULL and sets errno if either file can't be read.
+Tree* tree_open(const char* image_path, const char* journal_path);
+
+// Save the tree of `tree_open` to the image at `image_path`, replacing it, and drop the changes
+// the image contains from the journal. Changes wait only while those made during the compaction
+// are copied to the new journal. Returns 0, EINVAL if the tree isn't journaled,
+// or an errno value if saving fails.
+int tree_compact(Tree* tree, const char* image_path);
+
+typedef enum TreeEventKind {
+    TREE_EVENT_CREATE,
+    TREE_EVENT_REMOVE, // Of a folder, or of a whole subtree by `tree_remove_recursive`.
+    TREE_EVENT_MOVE,
+    TREE_EVENT_OVERFLOW, // Events have been dropped because the watch was full.
+} TreeEventKind;
+
+// A change of the tree, as returned by `tree_watch_next`. The caller should free it.
+typedef struct TreeEvent {
+    TreeEventKind kind;
+    const char* path; // The folder created or removed, or the source of a move. NULL for overflows.
+    const char* target; // The target of a move, NULL otherwise.
+    size_t lost; // For overflows, the number of events dropped.
+} TreeEvent;
+
+// A subscription to the changes of a subtree.
+typedef struct TreeWatch TreeWatch;
+
+// Watch the subtree at `path`, which need not exist: creations, removals and moves of the folder
+// and of its subfolders, and moves and removals of its ancestors that take the folder with them.
+// Events are published by the changes as they're made, in an order consistent with the order
+// of the changes. Returns NULL for an invalid path.
+// A change that no watch is interested in pays next to nothing for watches.
+TreeWatch* tree_watch(Tree* tree, const char* path);
+
+// Take the oldest unread event of the watch, or return NULL if there is none yet.
+// A watch buffers a bounded number of events; once it's full, events are dropped until
+// the reader catches up, and then reported as a single TREE_EVENT_OVERFLOW.
+// Only one thread may be reading a watch at a time.
+TreeEvent* tree_watch_next(TreeWatch* watch);
+
+// Stop watching and free the watch with its unread events.
+// Watches that are still open when their tree is freed are freed with it.
+void tree_unwatch(TreeWatch* watch);
@@ -0,0 +1,266 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "TreeImage.h"
+#include "path_utils.h"
+#include "err.h"
+
+#define IMAGE_MAGIC "FOLDTREE"
+#define IMAGE_VERSION 3
+
+/* Written in the byte order of the machine, so that other orders are recognized. */
+#define IMAGE_BYTE_ORDER 0x01020304u
+
+typedef struct ImageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t time; /* The image contains the changes of the tree made before that time. */
+    uint64_t node_count; /* Folders, stored right after the header. */
+    uint64_t names_size; /* Bytes of names, stored right after the folders. */
+} ImageHeader;
+
+struct TreeImage {
+    void *data;
+    size_t size;
+    unsigned long time;
+    const ImageNode *nodes;
+    uint64_t node_count;
+    const char *names;
+    uint64_t names_size;
+};
+
+/* Checks that the name at `offset` lies within the names and is a valid folder name.
+ * The names end with a null byte, which has been checked with the header. */
+static bool is_image_name_valid(const TreeImage *image, uint64_t offset) {
+    return offset < image->names_size && is_name_valid(image->names + offset);
+}
+
+/* Checks that the folders form a tree stored in breadth-first order, so that whatever is read
+ * from the image later lies within it: the children of every folder directly follow those
+ * of the folders before it, have valid names in strictly increasing order, and lie no deeper
+ * than a path can reach. Takes time proportional to the size of the image. */
+static bool are_nodes_valid(const TreeImage *image) {
+    uint64_t next_child = 1; /* Where the children of the next folder with any begin. */
+    uint64_t level_end = 1; /* Where the folders one level deeper begin. */
+    size_t depth = 0;
+    for (uint64_t i = 0; i < image->node_count; i++) {
+        if (i == level_end) {
+            depth++;
+            level_end = next_child;
+        }
+
+        const ImageNode *node = &image->nodes[i];
+        if (node->child_count == 0)
+            continue;
+        if (depth == MAX_PATH_DEPTH || node->first_child != next_child
+            || node->child_count > image->node_count - next_child)
+            return false;
+
+        for (uint32_t j = 0; j < node->child_count; j++) {
+            const ImageNode *child = &image->nodes[node->first_child + j];
+            if (!is_image_name_valid(image, child->name)
+                || (j > 0
+                    && strcmp(image->names + (child - 1)->name, image->names + child->name) >= 0))
+                return false;
+        }
+        next_child += node->child_count;
+    }
+    return next_child == image->node_count;
+}
+
+TreeImage *image_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat file;
+    if (fstat(fd, &file) != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+    if ((size_t) file.st_size < sizeof(ImageHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    void *data = mmap(NULL, file.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int error = errno;
+    close(fd);
+    if (data == MAP_FAILED) {
+        errno = error;
+        return NULL;
+    }
+
+    const ImageHeader *header = (const ImageHeader *) data;
+    size_t size = file.st_size;
+    size_t available = size - sizeof(ImageHeader);
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != IMAGE_VERSION || header->byte_order != IMAGE_BYTE_ORDER
+        || header->node_count == 0 || header->node_count > UINT32_MAX
+        || header->node_count > available / sizeof(ImageNode)
+        || header->names_size != available - header->node_count * sizeof(ImageNode)
+        || header->names_size == 0 || ((const char *) data)[size - 1] != '\0') {
+        munmap(data, size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    TreeImage *image = (TreeImage *) malloc(sizeof(TreeImage));
+    if (!image)
+        fatal("out of memory");
+    image->data = data;
+    image->size = size;
+    image->time = header->time;
+    image->nodes = (const ImageNode *) (header + 1);
+    image->node_count = header->node_count;
+    image->names = (const char *) (image->nodes + image->node_count);
+    image->names_size = header->names_size;
+
+    madvise(data, size, MADV_SEQUENTIAL);
+    if (!are_nodes_valid(image)) {
+        image_close(image);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    /* Afterwards, folders are read in no particular order, usually only a few of them. */
+    madvise(data, size, MADV_RANDOM);
+    return image;
+}
+
+void image_close(TreeImage *image) {
+    if (munmap(image->data, image->size) != 0)
+        syserr("munmap failed");
+    free(image);
+}
+
+unsigned long image_time(TreeImage *image) {
+    return image->time;
+}
+
+const ImageNode *image_root(TreeImage *image) {
+    return image->nodes;
+}
+
+const ImageNode *image_child(TreeImage *image, const ImageNode *node, uint32_t i, const char **name) {
+    const ImageNode *child = &image->nodes[node->first_child + i];
+    *name = image->names + child->name;
+    return child;
+}
+
+struct ImageBuilder {
+    ImageNode *nodes;
+    size_t node_count;
+    size_t node_capacity;
+    char *names;
+    size_t names_size;
+    size_t names_capacity;
+    size_t next_parent; /* The folder whose children are added next. */
+};
+
+ImageBuilder *image_builder_new() {
+    ImageBuilder *builder = (ImageBuilder *) calloc(1, sizeof(ImageBuilder));
+    if (!builder)
+        fatal("out of memory");
+    builder->node_capacity = 64;
+    builder->nodes = (ImageNode *) malloc(builder->node_capacity * sizeof(ImageNode));
+    builder->names_capacity = 1024;
+    builder->names = (char *) malloc(builder->names_capacity);
+    if (!builder->nodes || !builder->names)
+        fatal("out of memory");
+
+    /* The root has an empty name. */
+    builder->names[builder->names_size++] = '\0';
+    builder->nodes[0] = (ImageNode) { 0, 0, 0, 0, 0, 0 };
+    builder->node_count = 1;
+    return builder;
+}
+
+void image_builder_free(ImageBuilder *builder) {
+    free(builder->nodes);
+    free(builder->names);
+    free(builder);
+}
+
+void image_builder_add_children(ImageBuilder *builder, const char **names, size_t count) {
+    if (builder->next_parent >= builder->node_count
+        || builder->node_count + count > UINT32_MAX)
+        fatal("tree image too large");
+
+    ImageNode *parent = &builder->nodes[builder->next_parent++];
+    parent->first_child = (uint32_t) builder->node_count;
+    parent->child_count = (uint32_t) count;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t length = strlen(names[i]) + 1;
+        while (builder->names_size + length > builder->names_capacity) {
+            builder->names_capacity *= 2;
+            builder->names = (char *) realloc(builder->names, builder->names_capacity);
+            if (!builder->names)
+                fatal("out of memory");
+        }
+        if (builder->node_count == builder->node_capacity) {
+            builder->node_capacity *= 2;
+            builder->nodes = (ImageNode *) realloc(builder->nodes, builder->node_capacity * sizeof(ImageNode));
+            if (!builder->nodes)
+                fatal("out of memory");
+        }
+
+        builder->nodes[builder->node_count++] = (ImageNode) { builder->names_size, 0, 0, 0, 0, 0 };
+        memcpy(builder->names + builder->names_size, names[i], length);
+        builder->names_size += length;
+    }
+}
+
+/* Writes the whole buffer, unless an error occurs. */
+static int write_all(int fd, const void *buffer, size_t size) {
+    const char *data = (const char *) buffer;
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return errno;
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+int image_builder_write(ImageBuilder *builder, unsigned long time, int fd) {
+    /* Children come after their parents, so the statistics are summed up from the end. */
+    for (size_t i = builder->node_count; i-- > 0;) {
+        ImageNode *node = &builder->nodes[i];
+        for (uint32_t j = 0; j < node->child_count; j++) {
+            ImageNode *child = &builder->nodes[node->first_child + j];
+            node->descendants += child->descendants + 1;
+            node->name_bytes += child->name_bytes + strlen(builder->names + child->name);
+            if (child->max_depth + 1 > node->max_depth)
+                node->max_depth = child->max_depth + 1;
+        }
+    }
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.byte_order = IMAGE_BYTE_ORDER;
+    header.node_count = builder->node_count;
+    header.time = time;
+    header.names_size = builder->names_size;
+
+    int result = write_all(fd, &header, sizeof(header));
+    if (result == 0)
+        result = write_all(fd, builder->nodes, builder->node_count * sizeof(ImageNode));
+    if (result == 0)
+        result = write_all(fd, builder->names, builder->names_size);
+    return result;
+}
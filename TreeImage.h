@@ -0,0 +1,59 @@
+#ifndef TREEIMAGE_H
+#define TREEIMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A binary image of a folder tree, saved to a file and mapped back into memory.
+ * The folders are stored in breadth-first order, so that the children of every folder
+ * are contiguous, sorted by name. Their names are packed together after the folders.
+ * Images are meant to be read on the same kind of machine they were written on. */
+typedef struct TreeImage TreeImage;
+
+/* A folder of a mapped image. */
+typedef struct ImageNode {
+    uint64_t name; /* Offset of the null-terminated name. */
+    uint32_t first_child; /* Index of the first child. */
+    uint32_t child_count;
+    /* Statistics of the subtree below the folder, see `TreeStats`. */
+    uint64_t descendants;
+    uint64_t name_bytes;
+    uint64_t max_depth;
+} ImageNode;
+
+/* Maps the image saved in the file at `path`, checking all of it once, so that the folders
+ * can be read later without checks.
+ * Returns NULL and sets errno if the file can't be mapped or isn't a valid image. */
+TreeImage *image_open(const char *path);
+
+/* Unmaps the image. */
+void image_close(TreeImage *image);
+
+/* Returns the time of the tree's clock the image was taken at. */
+unsigned long image_time(TreeImage *image);
+
+/* Returns the root folder of the image. */
+const ImageNode *image_root(TreeImage *image);
+
+/* Returns the `i`-th child of `node`, which has to be less than its `child_count`,
+ * and sets `*name` to its name. */
+const ImageNode *image_child(TreeImage *image, const ImageNode *node, uint32_t i, const char **name);
+
+/* Collects folders in breadth-first order, to be written as an image. */
+typedef struct ImageBuilder ImageBuilder;
+
+/* Creates a builder holding just the root folder. */
+ImageBuilder *image_builder_new();
+
+/* Frees the builder. */
+void image_builder_free(ImageBuilder *builder);
+
+/* Adds the children of the next folder in breadth-first order, given their sorted names,
+ * which are copied. The root is the first folder. */
+void image_builder_add_children(ImageBuilder *builder, const char **names, size_t count);
+
+/* Writes the image of the tree taken at `time` to `fd`.
+ * Returns 0, or an error code if writing fails. */
+int image_builder_write(ImageBuilder *builder, unsigned long time, int fd);
+
+#endif //TREEIMAGE_H
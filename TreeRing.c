@@ -0,0 +1,270 @@
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "TreeRing.h"
+#include "err.h"
+
+/* Upper bound on the number of workers of a ring. */
+#define MAX_WORKERS 64
+
+/* A bounded queue for any number of producers and consumers. Every cell carries a sequence
+ * number telling whether it's ready to be filled or emptied in the current round. */
+typedef struct Cell {
+    atomic_size_t sequence;
+    union {
+        TreeRingRequest request;
+        TreeRingCompletion completion;
+    };
+} Cell;
+
+typedef struct Queue {
+    _Alignas(64) atomic_size_t tail; /* Position of the next cell to fill. */
+    _Alignas(64) atomic_size_t head; /* Position of the next cell to empty. */
+    size_t mask;
+    Cell *cells;
+} Queue;
+
+struct TreeRing {
+    Tree *tree;
+    Queue submissions;
+    Queue completions;
+    sem_t submitted; /* Requests in `submissions`, and stop signals. */
+    sem_t completed; /* Completions in `completions`. */
+
+    unsigned max_in_flight;
+    _Alignas(64) atomic_uint in_flight; /* Requests submitted and not reaped yet. */
+    atomic_bool stopping;
+
+    unsigned n_workers;
+    pthread_t workers[MAX_WORKERS];
+};
+
+static void queue_init(Queue *queue, size_t capacity) {
+    queue->cells = (Cell *) malloc(capacity * sizeof(Cell));
+    if (!queue->cells)
+        fatal("out of memory");
+    for (size_t i = 0; i < capacity; i++)
+        atomic_init(&queue->cells[i].sequence, i);
+    queue->mask = capacity - 1;
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->head, 0);
+}
+
+/* Reserves a cell to fill. There has to be a free one. */
+static Cell *queue_reserve(Queue *queue) {
+    size_t position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    while (true) {
+        Cell *cell = &queue->cells[position & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        if (sequence == position) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                return cell;
+        }
+        else if (sequence < position) {
+            /* The consumer of the previous round hasn't emptied the cell yet. */
+            sched_yield();
+            position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+        else {
+            position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+}
+
+/* Makes a filled cell available to consumers. */
+static void queue_publish(Queue *queue, Cell *cell) {
+    size_t position = atomic_load_explicit(&cell->sequence, memory_order_relaxed);
+    (void) queue;
+    atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+}
+
+/* Takes the oldest filled cell, or returns NULL if there's none ready. */
+static Cell *queue_take(Queue *queue) {
+    size_t position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    while (true) {
+        Cell *cell = &queue->cells[position & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        if (sequence == position + 1) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                return cell;
+        }
+        else if (sequence < position + 1) {
+            return NULL;
+        }
+        else {
+            position = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        }
+    }
+}
+
+/* Makes an emptied cell available to producers of the next round. */
+static void queue_release(Queue *queue, Cell *cell) {
+    size_t position = atomic_load_explicit(&cell->sequence, memory_order_relaxed) - 1;
+    atomic_store_explicit(&cell->sequence, position + queue->mask + 1, memory_order_release);
+}
+
+/* Takes a cell that is known to be filled, waiting for its producer to publish it. */
+static Cell *queue_take_counted(Queue *queue) {
+    Cell *cell;
+    while (!(cell = queue_take(queue)))
+        sched_yield();
+    return cell;
+}
+
+static void sem_wait_uninterrupted(sem_t *semaphore) {
+    while (sem_wait(semaphore) != 0) {
+        if (errno != EINTR)
+            syserr("sem_wait failed");
+    }
+}
+
+static TreeRingCompletion execute(Tree *tree, const TreeRingRequest *request) {
+    TreeRingCompletion completion = { request->user_data, 0, NULL };
+    switch (request->op) {
+        case TREE_RING_CREATE:
+            completion.result = tree_create(tree, request->path);
+            break;
+        case TREE_RING_REMOVE:
+            completion.result = tree_remove(tree, request->path);
+            break;
+        case TREE_RING_MOVE:
+            completion.result = tree_move(tree, request->path, request->target);
+            break;
+        case TREE_RING_LIST:
+            completion.listing = tree_list(tree, request->path);
+            completion.result = completion.listing ? 0 : ENOENT;
+            break;
+        default:
+            completion.result = EINVAL;
+    }
+    return completion;
+}
+
+static void *worker(void *arg) {
+    TreeRing *ring = (TreeRing *) arg;
+
+    while (true) {
+        sem_wait_uninterrupted(&ring->submitted);
+        Cell *cell = queue_take(&ring->submissions);
+        if (!cell && atomic_load(&ring->stopping))
+            break;
+        if (!cell)
+            cell = queue_take_counted(&ring->submissions);
+
+        TreeRingRequest request = cell->request;
+        queue_release(&ring->submissions, cell);
+        TreeRingCompletion completion = execute(ring->tree, &request);
+
+        cell = queue_reserve(&ring->completions);
+        cell->completion = completion;
+        queue_publish(&ring->completions, cell);
+        if (sem_post(&ring->completed) != 0)
+            syserr("sem_post failed");
+    }
+
+    return NULL;
+}
+
+TreeRing *tree_ring_new(Tree *tree, unsigned n_workers, unsigned max_in_flight) {
+    TreeRing *ring = (TreeRing *) calloc(1, sizeof(TreeRing));
+    if (!ring)
+        fatal("out of memory");
+    ring->tree = tree;
+
+    /* The rings are large enough for all requests in flight, so they never overflow. */
+    size_t capacity = 2;
+    while (capacity < max_in_flight)
+        capacity *= 2;
+    queue_init(&ring->submissions, capacity);
+    queue_init(&ring->completions, capacity);
+    ring->max_in_flight = max_in_flight;
+    atomic_init(&ring->in_flight, 0);
+    atomic_init(&ring->stopping, false);
+    if (sem_init(&ring->submitted, 0, 0) != 0 || sem_init(&ring->completed, 0, 0) != 0)
+        syserr("sem_init failed");
+
+    if (n_workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_workers = cpus > 0 ? (unsigned) cpus : 1;
+    }
+    ring->n_workers = n_workers < MAX_WORKERS ? n_workers : MAX_WORKERS;
+    for (unsigned i = 0; i < ring->n_workers; i++) {
+        if (pthread_create(&ring->workers[i], NULL, worker, ring) != 0)
+            syserr("pthread_create failed");
+    }
+
+    return ring;
+}
+
+void tree_ring_free(TreeRing *ring) {
+    /* Every worker leaves once it finds no request after a stop signal. */
+    atomic_store(&ring->stopping, true);
+    for (unsigned i = 0; i < ring->n_workers; i++) {
+        if (sem_post(&ring->submitted) != 0)
+            syserr("sem_post failed");
+    }
+    for (unsigned i = 0; i < ring->n_workers; i++) {
+        if (pthread_join(ring->workers[i], NULL) != 0)
+            syserr("pthread_join failed");
+    }
+
+    Cell *cell;
+    while ((cell = queue_take(&ring->completions)))
+        free(cell->completion.listing);
+
+    sem_destroy(&ring->submitted);
+    sem_destroy(&ring->completed);
+    free(ring->submissions.cells);
+    free(ring->completions.cells);
+    free(ring);
+}
+
+unsigned tree_ring_submit(TreeRing *ring, const TreeRingRequest *requests, unsigned count) {
+    /* Room for the whole batch is reserved at once. */
+    unsigned in_flight = atomic_load(&ring->in_flight), accepted;
+    do {
+        unsigned room = ring->max_in_flight - in_flight;
+        accepted = count < room ? count : room;
+        if (accepted == 0)
+            return 0;
+    } while (!atomic_compare_exchange_weak(&ring->in_flight, &in_flight, in_flight + accepted));
+
+    for (unsigned i = 0; i < accepted; i++) {
+        Cell *cell = queue_reserve(&ring->submissions);
+        cell->request = requests[i];
+        queue_publish(&ring->submissions, cell);
+        if (sem_post(&ring->submitted) != 0)
+            syserr("sem_post failed");
+    }
+    return accepted;
+}
+
+/* Reaps a completion that is known to be there. */
+static void reap_one(TreeRing *ring, TreeRingCompletion *completion) {
+    Cell *cell = queue_take_counted(&ring->completions);
+    *completion = cell->completion;
+    queue_release(&ring->completions, cell);
+    atomic_fetch_sub(&ring->in_flight, 1);
+}
+
+unsigned tree_ring_reap(TreeRing *ring, TreeRingCompletion *completions, unsigned max) {
+    unsigned reaped = 0;
+    while (reaped < max && sem_trywait(&ring->completed) == 0)
+        reap_one(ring, &completions[reaped++]);
+    return reaped;
+}
+
+unsigned tree_ring_wait(TreeRing *ring, TreeRingCompletion *completions, unsigned max) {
+    if (max == 0)
+        return 0;
+    sem_wait_uninterrupted(&ring->completed);
+    reap_one(ring, &completions[0]);
+    return 1 + tree_ring_reap(ring, completions + 1, max - 1);
+}
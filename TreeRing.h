@@ -0,0 +1,53 @@
+#ifndef TREERING_H
+#define TREERING_H
+
+#include <stdint.h>
+#include "Tree.h"
+
+/* Asynchronous execution of tree operations.
+ * Requests are submitted to a ring and executed by the ring's worker threads, which may block
+ * on busy folders in place of the submitters. Their results are reaped from a second ring.
+ * Neither submitting nor reaping takes locks. */
+typedef struct TreeRing TreeRing;
+
+typedef enum TreeRingOp {
+    TREE_RING_CREATE,
+    TREE_RING_REMOVE,
+    TREE_RING_MOVE,
+    TREE_RING_LIST,
+} TreeRingOp;
+
+typedef struct TreeRingRequest {
+    TreeRingOp op;
+    /* The paths have to stay valid until the completion of the request is reaped. */
+    const char *path;
+    const char *target; /* Only for moves. */
+    uint64_t user_data; /* Passed back in the completion. */
+} TreeRingRequest;
+
+typedef struct TreeRingCompletion {
+    uint64_t user_data;
+    int result; /* What the operation returned, or for lists 0 or ENOENT. */
+    char *listing; /* For lists, the result of `tree_list`. The caller should free it. */
+} TreeRingCompletion;
+
+/* Creates a ring executing requests against `tree` on `n_workers` threads, or on one per CPU
+ * if 0. At most `max_in_flight` requests may be submitted and not yet reaped at a time. */
+TreeRing *tree_ring_new(Tree *tree, unsigned n_workers, unsigned max_in_flight);
+
+/* Waits for the submitted requests to be executed, drops the completions that haven't been
+ * reaped, stops the workers and frees the ring. */
+void tree_ring_free(TreeRing *ring);
+
+/* Submits up to `count` requests, as many as fit within the limit of requests in flight.
+ * Returns how many have been submitted, from the first one. */
+unsigned tree_ring_submit(TreeRing *ring, const TreeRingRequest *requests, unsigned count);
+
+/* Reaps up to `max` completions, in no particular order, without waiting.
+ * Returns how many have been reaped. */
+unsigned tree_ring_reap(TreeRing *ring, TreeRingCompletion *completions, unsigned max);
+
+/* Like `tree_ring_reap`, but waits for at least one completion if `max` is positive. */
+unsigned tree_ring_wait(TreeRing *ring, TreeRingCompletion *completions, unsigned max);
+
+#endif //TREERING_H
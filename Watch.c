@@ -0,0 +1,234 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Watch.h"
+#include "epoch.h"
+#include "err.h"
+
+/* Number of unread events a watch keeps, a power of two. Events published while it's full are
+ * dropped and reported as a single overflow once the reader has caught up. */
+#define WATCH_CAPACITY 1024
+
+typedef struct Cell {
+    /* Equal to the position of the cell while it's free, one more once its event is published. */
+    atomic_size_t sequence;
+    TreeEvent *event;
+} Cell;
+
+struct TreeWatch {
+    Watchers *watchers;
+    size_t length;
+    char *path;
+
+    _Alignas(64) atomic_size_t tail; /* Position of the next cell to publish to. */
+    atomic_size_t lost; /* Events dropped since the reader last caught up. */
+    _Alignas(64) size_t head; /* Position of the next cell to read, only used by the reader. */
+    Cell cells[WATCH_CAPACITY];
+};
+
+/* Never modified, only replaced, so that it's read without locks. */
+typedef struct WatchList {
+    size_t count;
+    TreeWatch *watches[];
+} WatchList;
+
+struct Watchers {
+    _Atomic(WatchList *) list; /* NULL while there are no watches. */
+    pthread_mutex_t lock; /* Serializes replacing the list. */
+};
+
+static void lock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_lock(mutex) != 0)
+        syserr("lock failed");
+}
+
+static void unlock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_unlock(mutex) != 0)
+        syserr("unlock failed");
+}
+
+Watchers *watchers_new() {
+    Watchers *watchers = (Watchers *) malloc(sizeof(Watchers));
+    if (!watchers)
+        fatal("out of memory");
+    atomic_init(&watchers->list, NULL);
+    if (pthread_mutex_init(&watchers->lock, 0) != 0)
+        syserr("mutex init failed");
+    return watchers;
+}
+
+static void free_watch(TreeWatch *watch) {
+    TreeEvent *event;
+    while ((event = watch_next(watch)))
+        free(event);
+    free(watch->path);
+    free(watch);
+}
+
+void watchers_free(Watchers *watchers) {
+    WatchList *list = atomic_load(&watchers->list);
+    if (list) {
+        for (size_t i = 0; i < list->count; i++)
+            free_watch(list->watches[i]);
+        free(list);
+    }
+    if (pthread_mutex_destroy(&watchers->lock) != 0)
+        syserr("mutex destroy failed");
+    free(watchers);
+}
+
+/* Returns a copy of `list` with `added` in place of `removed`, or NULL if it would be empty.
+ * Either of them may be NULL. */
+static WatchList *replace_watch(const WatchList *list, TreeWatch *removed, TreeWatch *added) {
+    size_t count = list ? list->count : 0;
+    size_t new_count = count - (removed != NULL) + (added != NULL);
+    if (new_count == 0)
+        return NULL;
+
+    WatchList *new_list = (WatchList *) malloc(sizeof(WatchList) + new_count * sizeof(TreeWatch *));
+    if (!new_list)
+        fatal("out of memory");
+    new_list->count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (list->watches[i] != removed)
+            new_list->watches[new_list->count++] = list->watches[i];
+    }
+    if (added)
+        new_list->watches[new_list->count++] = added;
+    return new_list;
+}
+
+TreeWatch *watchers_add(Watchers *watchers, const char *path) {
+    TreeWatch *watch = (TreeWatch *) malloc(sizeof(TreeWatch));
+    if (!watch)
+        fatal("out of memory");
+    watch->watchers = watchers;
+    watch->length = strlen(path);
+    watch->path = strdup(path);
+    if (!watch->path)
+        fatal("out of memory");
+    atomic_init(&watch->tail, 0);
+    atomic_init(&watch->lost, 0);
+    watch->head = 0;
+    for (size_t i = 0; i < WATCH_CAPACITY; i++) {
+        atomic_init(&watch->cells[i].sequence, i);
+        watch->cells[i].event = NULL;
+    }
+
+    lock(&watchers->lock);
+    WatchList *list = atomic_load(&watchers->list);
+    atomic_store(&watchers->list, replace_watch(list, NULL, watch));
+    unlock(&watchers->lock);
+    if (list)
+        epoch_retire(list, free);
+    return watch;
+}
+
+void watchers_remove(TreeWatch *watch) {
+    Watchers *watchers = watch->watchers;
+
+    lock(&watchers->lock);
+    WatchList *list = atomic_load(&watchers->list);
+    atomic_store(&watchers->list, replace_watch(list, watch, NULL));
+    unlock(&watchers->lock);
+
+    /* Changes that may still be publishing to the watch are waited for. */
+    epoch_synchronize();
+    free(list);
+    free_watch(watch);
+}
+
+static TreeEvent *new_event(TreeEventKind kind, const char *path, const char *target, size_t lost) {
+    size_t path_size = path ? strlen(path) + 1 : 0;
+    size_t target_size = target ? strlen(target) + 1 : 0;
+
+    /* The paths are stored right after the event, so that it's freed at once. */
+    TreeEvent *event = (TreeEvent *) malloc(sizeof(TreeEvent) + path_size + target_size);
+    if (!event)
+        fatal("out of memory");
+    char *strings = (char *) (event + 1);
+    event->kind = kind;
+    event->path = path ? memcpy(strings, path, path_size) : NULL;
+    event->target = target ? memcpy(strings + path_size, target, target_size) : NULL;
+    event->lost = lost;
+    return event;
+}
+
+/* Publishes an event to a watch, or drops it if the watch is full. */
+static void publish(TreeWatch *watch, TreeEventKind kind, const char *path, const char *target) {
+    /* Once an event has been dropped, the later ones are too until the reader catches up,
+     * so that the reader learns about the overflow where it happened. */
+    if (atomic_load_explicit(&watch->lost, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&watch->lost, 1);
+        return;
+    }
+
+    size_t position = atomic_load_explicit(&watch->tail, memory_order_relaxed);
+    Cell *cell;
+    while (true) {
+        cell = &watch->cells[position & (WATCH_CAPACITY - 1)];
+        intptr_t difference = (intptr_t) atomic_load_explicit(&cell->sequence, memory_order_acquire)
+                              - (intptr_t) position;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&watch->tail, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (difference < 0) {
+            /* The cell still holds an unread event from the previous round. */
+            atomic_fetch_add(&watch->lost, 1);
+            return;
+        }
+        else {
+            position = atomic_load_explicit(&watch->tail, memory_order_relaxed);
+        }
+    }
+
+    cell->event = new_event(kind, path, target, 0);
+    atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+}
+
+/* Checks whether the valid path `b` is `a` or one of its subfolders. */
+static bool is_within(const char *a, size_t a_length, const char *b) {
+    return strncmp(a, b, a_length) == 0;
+}
+
+bool watchers_any(Watchers *watchers) {
+    return atomic_load_explicit(&watchers->list, memory_order_acquire) != NULL;
+}
+
+void watchers_notify(Watchers *watchers, TreeEventKind kind, const char *path, const char *target,
+                     bool subtree) {
+    WatchList *list = atomic_load_explicit(&watchers->list, memory_order_acquire);
+    if (!list)
+        return;
+
+    size_t path_length = strlen(path);
+    size_t target_length = target ? strlen(target) : 0;
+    for (size_t i = 0; i < list->count; i++) {
+        TreeWatch *watch = list->watches[i];
+        bool affected = is_within(watch->path, watch->length, path)
+                        || (target && is_within(watch->path, watch->length, target))
+                        || (subtree && is_within(path, path_length, watch->path))
+                        || (subtree && target && is_within(target, target_length, watch->path));
+        if (affected)
+            publish(watch, kind, path, target);
+    }
+}
+
+TreeEvent *watch_next(TreeWatch *watch) {
+    Cell *cell = &watch->cells[watch->head & (WATCH_CAPACITY - 1)];
+    if (atomic_load_explicit(&cell->sequence, memory_order_acquire) == watch->head + 1) {
+        TreeEvent *event = cell->event;
+        atomic_store_explicit(&cell->sequence, watch->head + WATCH_CAPACITY, memory_order_release);
+        watch->head++;
+        return event;
+    }
+
+    /* The overflow is reported only once nothing published before it is left. */
+    if (atomic_load(&watch->tail) == watch->head && atomic_load(&watch->lost) > 0)
+        return new_event(TREE_EVENT_OVERFLOW, NULL, NULL, atomic_exchange(&watch->lost, 0));
+    return NULL;
+}
@@ -0,0 +1,39 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdbool.h>
+#include "Tree.h"
+
+/* The subscribers to the changes of a tree. Changes are published to every watch of a path
+ * they affect, each of which buffers a bounded number of events for a single reader.
+ * A change that no watch is interested in costs a single atomic load. */
+typedef struct Watchers Watchers;
+
+/* Creates an empty set of watchers. */
+Watchers *watchers_new();
+
+/* Frees the set together with the watches still in it. No other process may be using them. */
+void watchers_free(Watchers *watchers);
+
+/* Adds a watch of the subtree at the valid path. */
+TreeWatch *watchers_add(Watchers *watchers, const char *path);
+
+/* Removes a watch and frees it together with its unread events.
+ * Must not be called within an epoch critical section. */
+void watchers_remove(TreeWatch *watch);
+
+/* Checks whether there are any watches, so that a change that takes some work to publish can
+ * skip it when there are none. Must be called within an epoch critical section. */
+bool watchers_any(Watchers *watchers);
+
+/* Publishes a change to the watches it affects. `subtree` tells whether the change moves or
+ * removes the whole subtree at `path`, so that it affects the watches below it as well.
+ * `target` is NULL unless the change is a move. Must be called within an epoch critical section. */
+void watchers_notify(Watchers *watchers, TreeEventKind kind, const char *path, const char *target,
+                     bool subtree);
+
+/* Takes the oldest unread event of a watch, or returns NULL if there is none.
+ * Only one process may be reading a watch at a time. */
+TreeEvent *watch_next(TreeWatch *watch);
+
+#endif //WATCH_H
@@ -0,0 +1,409 @@
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "Tree.h"
+#include "path_utils.h"
+#include "err.h"
+
+/* A multi-threaded workload over the Tree API.
+ * Builds a tree with the given fan-out and depth, then runs threads that perform a mix
+ * of operations on folders picked from the tree, uniformly or with Zipfian skew.
+ * Reports throughput and latency percentiles for every kind of operation. */
+
+enum { OP_LIST, OP_CREATE, OP_REMOVE, OP_MOVE, N_OPS };
+
+static const char *op_names[N_OPS] = { "list", "create", "remove", "move" };
+
+/* Latency histogram with 16 linear sub-buckets per power of two of nanoseconds. */
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define N_BUCKETS (64 * SUB_BUCKETS)
+
+/* Names of the folders created and removed by the workload, per parent folder. */
+#define SCRATCH_NAMES 8
+
+typedef struct Histogram {
+    uint64_t counts[N_BUCKETS];
+    uint64_t total;
+} Histogram;
+
+typedef struct Options {
+    int threads;
+    int fanout;
+    int depth;
+    double seconds;
+    unsigned ratios[N_OPS];
+    double zipf_theta;
+    unsigned seed;
+    TreeLockPolicy policy;
+    bool spin;
+} Options;
+
+/* Zipfian distribution over ranks 0..n-1, as in Gray et al., "Quickly Generating
+ * Billion-Record Synthetic Databases". A theta of 0 means uniform. */
+typedef struct Zipf {
+    size_t n;
+    double theta;
+    double alpha;
+    double zeta_n;
+    double eta;
+} Zipf;
+
+typedef struct Worker {
+    pthread_t thread;
+    uint64_t rng;
+    Histogram histograms[N_OPS];
+    uint64_t errors[N_OPS];
+} Worker;
+
+static Options options = {
+    .threads = 4,
+    .fanout = 8,
+    .depth = 4,
+    .seconds = 5.0,
+    .ratios = { 80, 8, 8, 4 },
+    .zipf_theta = 0.0,
+    .seed = 1,
+    .policy = TREE_LOCK_HANDOFF,
+    .spin = true,
+};
+
+static const char *policy_names[] = { "handoff", "phase", "writers" };
+
+static Tree *tree;
+static char **folders; /* Paths of all folders of the initial tree, the root first. */
+static size_t n_folders;
+static Zipf zipf;
+static atomic_bool running;
+
+#ifdef NODE_FUTEX_LOCK
+static const char *lock_name = "futex";
+#else
+static const char *lock_name = "pthread";
+#endif
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+        syserr("clock_gettime failed");
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+static double next_double(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / (1ull << 53));
+}
+
+static void zipf_init(Zipf *z, size_t n, double theta) {
+    z->n = n;
+    z->theta = theta;
+    if (theta == 0.0)
+        return;
+    double zeta_2 = 1.0 + pow(0.5, theta);
+    z->zeta_n = 0.0;
+    for (size_t i = 1; i <= n; i++)
+        z->zeta_n += 1.0 / pow((double) i, theta);
+    z->alpha = 1.0 / (1.0 - theta);
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta_2 / z->zeta_n);
+}
+
+static size_t zipf_next(const Zipf *z, uint64_t *rng) {
+    if (z->theta == 0.0)
+        return next_random(rng) % z->n;
+    double u = next_double(rng);
+    double uz = u * z->zeta_n;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + pow(0.5, z->theta))
+        return 1 % z->n;
+    size_t rank = (size_t) (z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return rank < z->n ? rank : z->n - 1;
+}
+
+static int bucket_of(uint64_t value) {
+    if (value < SUB_BUCKETS)
+        return (int) value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + (int) ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+/* The smallest value that falls into `bucket`. */
+static uint64_t bucket_value(int bucket) {
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+    int shift = bucket / SUB_BUCKETS - 1;
+    return ((uint64_t) SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+}
+
+static void histogram_record(Histogram *h, uint64_t value) {
+    h->counts[bucket_of(value)]++;
+    h->total++;
+}
+
+static void histogram_merge(Histogram *into, const Histogram *from) {
+    for (int i = 0; i < N_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    into->total += from->total;
+}
+
+static uint64_t histogram_percentile(const Histogram *h, double percentile) {
+    if (h->total == 0)
+        return 0;
+    uint64_t rank = (uint64_t) ceil(percentile / 100.0 * h->total);
+    uint64_t seen = 0;
+    for (int i = 0; i < N_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank && h->counts[i] > 0)
+            return bucket_value(i);
+    }
+    return bucket_value(N_BUCKETS - 1);
+}
+
+/* Creates the initial tree breadth-first and remembers the paths of its folders. */
+static void build_tree() {
+    size_t total = 1, level = 1;
+    for (int d = 0; d < options.depth; d++) {
+        level *= options.fanout;
+        total += level;
+    }
+
+    folders = (char **) malloc(total * sizeof(char *));
+    if (!folders)
+        fatal("out of memory");
+    folders[0] = strdup("/");
+    n_folders = 1;
+
+    size_t level_start = 0, level_end = 1;
+    for (int d = 0; d < options.depth; d++) {
+        for (size_t i = level_start; i < level_end; i++) {
+            for (int c = 0; c < options.fanout; c++) {
+                char path[MAX_PATH_LENGTH + 1];
+                int len = snprintf(path, sizeof(path), "%sn", folders[i]);
+                /* Folder names are 'a'-'z' only, so the child number is written in base 26. */
+                for (int k = c; ; k /= 26) {
+                    path[len++] = (char) ('a' + k % 26);
+                    if (k < 26)
+                        break;
+                }
+                path[len++] = '/';
+                path[len] = '\0';
+                if (len > MAX_PATH_LENGTH)
+                    fatal("tree too deep for MAX_PATH_LENGTH");
+                int err = tree_create(tree, path);
+                if (err != 0)
+                    fatal("creating %s failed with %d", path, err);
+                folders[n_folders++] = strdup(path);
+            }
+        }
+        level_start = level_end;
+        level_end = n_folders;
+    }
+}
+
+/* Writes the path of a scratch folder under a random folder of the initial tree. */
+static void scratch_path(Worker *worker, char *path) {
+    const char *parent = folders[zipf_next(&zipf, &worker->rng)];
+    int name = (int) (next_random(&worker->rng) % SCRATCH_NAMES);
+    size_t len = strlen(parent);
+    if (len + 3 > MAX_PATH_LENGTH)
+        len = 1, parent = "/";
+    memcpy(path, parent, len);
+    path[len] = 'z';
+    path[len + 1] = (char) ('a' + name);
+    path[len + 2] = '/';
+    path[len + 3] = '\0';
+}
+
+static int pick_op(Worker *worker) {
+    unsigned sum = 0;
+    for (int op = 0; op < N_OPS; op++)
+        sum += options.ratios[op];
+    unsigned r = (unsigned) (next_random(&worker->rng) % sum);
+    for (int op = 0; op < N_OPS; op++) {
+        if (r < options.ratios[op])
+            return op;
+        r -= options.ratios[op];
+    }
+    return OP_LIST;
+}
+
+static void *worker_main(void *arg) {
+    Worker *worker = (Worker *) arg;
+    char path[MAX_PATH_LENGTH + 1], target[MAX_PATH_LENGTH + 1];
+
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        int op = pick_op(worker);
+        int err = 0;
+        uint64_t start = now_ns();
+
+        switch (op) {
+            case OP_LIST: {
+                char *list = tree_list(tree, folders[zipf_next(&zipf, &worker->rng)]);
+                err = list ? 0 : ENOENT;
+                free(list);
+                break;
+            }
+            case OP_CREATE:
+                scratch_path(worker, path);
+                err = tree_create(tree, path);
+                break;
+            case OP_REMOVE:
+                scratch_path(worker, path);
+                err = tree_remove(tree, path);
+                break;
+            case OP_MOVE:
+                scratch_path(worker, path);
+                scratch_path(worker, target);
+                err = tree_move(tree, path, target);
+                break;
+        }
+
+        histogram_record(&worker->histograms[op], now_ns() - start);
+        if (err != 0)
+            worker->errors[op]++;
+    }
+    return NULL;
+}
+
+static void parse_ratios(const char *arg) {
+    unsigned r[N_OPS];
+    if (sscanf(arg, "%u:%u:%u:%u", &r[0], &r[1], &r[2], &r[3]) != N_OPS
+        || r[0] + r[1] + r[2] + r[3] == 0)
+        fatal("invalid mix '%s', expected list:create:remove:move", arg);
+    memcpy(options.ratios, r, sizeof(r));
+}
+
+static void parse_policy(const char *arg) {
+    for (int i = 0; i < (int) (sizeof(policy_names) / sizeof(policy_names[0])); i++) {
+        if (strcmp(arg, policy_names[i]) == 0) {
+            options.policy = (TreeLockPolicy) i;
+            return;
+        }
+    }
+    fatal("invalid lock policy '%s', expected handoff, phase or writers", arg);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [-t threads] [-f fanout] [-d depth] [-s seconds]\n"
+            "          [-m list:create:remove:move] [-z zipf_theta] [-r seed]\n"
+            "          [-p handoff|phase|writers] [-n (don't spin before blocking)]\n", program);
+    exit(1);
+}
+
+static void parse_options(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:f:d:s:m:z:r:p:nh")) != -1) {
+        switch (opt) {
+            case 't': options.threads = atoi(optarg); break;
+            case 'f': options.fanout = atoi(optarg); break;
+            case 'd': options.depth = atoi(optarg); break;
+            case 's': options.seconds = atof(optarg); break;
+            case 'm': parse_ratios(optarg); break;
+            case 'z': options.zipf_theta = atof(optarg); break;
+            case 'r': options.seed = (unsigned) atoi(optarg); break;
+            case 'p': parse_policy(optarg); break;
+            case 'n': options.spin = false; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (options.threads < 1 || options.fanout < 1 || options.depth < 0 || options.seconds <= 0
+        || options.zipf_theta < 0 || options.zipf_theta >= 1)
+        usage(argv[0]);
+}
+
+int main(int argc, char **argv) {
+    parse_options(argc, argv);
+
+    tree_set_lock_policy(options.policy, options.spin);
+    tree = tree_new();
+    uint64_t build_start = now_ns();
+    build_tree();
+    double build_seconds = (now_ns() - build_start) / 1e9;
+    zipf_init(&zipf, n_folders, options.zipf_theta);
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        syserr("getrusage failed");
+
+    printf("%s lock, %s policy%s, max RSS %ld KiB after build\n", lock_name,
+           policy_names[options.policy], options.spin ? "" : " without spinning", usage.ru_maxrss);
+    printf("threads %d, fanout %d, depth %d, folders %zu (built in %.3f s), mix %u:%u:%u:%u, zipf %.2f\n",
+           options.threads, options.fanout, options.depth, n_folders, build_seconds,
+           options.ratios[OP_LIST], options.ratios[OP_CREATE], options.ratios[OP_REMOVE],
+           options.ratios[OP_MOVE], options.zipf_theta);
+
+    Worker *workers = (Worker *) calloc(options.threads, sizeof(Worker));
+    if (!workers)
+        fatal("out of memory");
+
+    atomic_store(&running, true);
+    uint64_t start = now_ns();
+    for (int i = 0; i < options.threads; i++) {
+        workers[i].rng = (uint64_t) options.seed * 0x9E3779B97F4A7C15ull + i + 1;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+            syserr("pthread_create failed");
+    }
+
+    struct timespec duration = {
+        (time_t) options.seconds,
+        (long) ((options.seconds - (time_t) options.seconds) * 1e9)
+    };
+    nanosleep(&duration, NULL);
+    atomic_store(&running, false);
+
+    for (int i = 0; i < options.threads; i++) {
+        if (pthread_join(workers[i].thread, NULL) != 0)
+            syserr("pthread_join failed");
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    Histogram *all = (Histogram *) calloc(N_OPS + 1, sizeof(Histogram));
+    uint64_t errors[N_OPS] = { 0 };
+    for (int i = 0; i < options.threads; i++) {
+        for (int op = 0; op < N_OPS; op++) {
+            histogram_merge(&all[op], &workers[i].histograms[op]);
+            histogram_merge(&all[N_OPS], &workers[i].histograms[op]);
+            errors[op] += workers[i].errors[op];
+        }
+    }
+
+    printf("%-8s %12s %12s %8s %10s %10s %10s\n",
+           "op", "count", "ops/s", "failed", "p50 ns", "p99 ns", "p999 ns");
+    for (int op = 0; op <= N_OPS; op++) {
+        const Histogram *h = &all[op];
+        printf("%-8s %12llu %12.0f %7.1f%% %10llu %10llu %10llu\n",
+               op < N_OPS ? op_names[op] : "total",
+               (unsigned long long) h->total, h->total / elapsed,
+               op < N_OPS && h->total ? 100.0 * errors[op] / h->total : 0.0,
+               (unsigned long long) histogram_percentile(h, 50),
+               (unsigned long long) histogram_percentile(h, 99),
+               (unsigned long long) histogram_percentile(h, 99.9));
+    }
+
+    free(all);
+    free(workers);
+    for (size_t i = 0; i < n_folders; i++)
+        free(folders[i]);
+    free(folders);
+    tree_free(tree);
+    return 0;
+}
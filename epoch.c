@@ -0,0 +1,230 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "epoch.h"
+#include "err.h"
+
+/* Every thread announces the global epoch it observed when entering a critical section.
+ * The global epoch advances only when all active threads have announced it, so memory
+ * retired in epoch `e` can no longer be referenced once the global epoch reaches `e + 2`. */
+
+/* How many retirements a thread makes before trying to advance the epoch and free memory. */
+#define RETIRE_THRESHOLD 64
+
+typedef struct Retired {
+    void *ptr;
+    void (*free_fn)(void *);
+    unsigned long epoch;
+} Retired;
+
+typedef struct RetireList {
+    Retired *items;
+    size_t count;
+    size_t capacity;
+} RetireList;
+
+typedef struct EpochRecord EpochRecord;
+
+struct EpochRecord {
+    /* (epoch << 1) | 1 while inside a critical section, 0 otherwise. */
+    atomic_ulong state;
+    int nesting;
+    unsigned retired_since_collect;
+
+    /* Retired memory of this thread. Locked only by its owner and `epoch_barrier`. */
+    pthread_mutex_t limbo_lock;
+    RetireList limbo;
+
+    atomic_bool in_use;
+    EpochRecord *next;
+};
+
+static atomic_ulong global_epoch = 1;
+static _Atomic(EpochRecord *) records = NULL;
+
+/* Memory retired by threads that have already exited. */
+static pthread_mutex_t orphans_lock = PTHREAD_MUTEX_INITIALIZER;
+static RetireList orphans;
+
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t record_key;
+static __thread EpochRecord *local_record;
+
+static void retire_list_push(RetireList *list, Retired item) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? 2 * list->capacity : RETIRE_THRESHOLD;
+        Retired *items = realloc(list->items, capacity * sizeof(Retired));
+        if (!items)
+            fatal("out of memory");
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = item;
+}
+
+/* Moves items that are safe to free in `epoch` from `list` to `ready`. */
+static void retire_list_take_ready(RetireList *list, unsigned long epoch, RetireList *ready) {
+    size_t kept = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        if (list->items[i].epoch + 2 <= epoch)
+            retire_list_push(ready, list->items[i]);
+        else
+            list->items[kept++] = list->items[i];
+    }
+    list->count = kept;
+}
+
+static void retire_list_run(RetireList *list) {
+    for (size_t i = 0; i < list->count; i++)
+        list->items[i].free_fn(list->items[i].ptr);
+    free(list->items);
+}
+
+static void lock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_lock(mutex) != 0)
+        syserr("lock failed");
+}
+
+static void unlock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_unlock(mutex) != 0)
+        syserr("unlock failed");
+}
+
+/* Hands the memory retired by an exiting thread over to the orphans list. */
+static void release_record(void *arg) {
+    EpochRecord *record = (EpochRecord *) arg;
+
+    lock(&record->limbo_lock);
+    lock(&orphans_lock);
+    for (size_t i = 0; i < record->limbo.count; i++)
+        retire_list_push(&orphans, record->limbo.items[i]);
+    unlock(&orphans_lock);
+    record->limbo.count = 0;
+    unlock(&record->limbo_lock);
+
+    record->nesting = 0;
+    atomic_store(&record->state, 0);
+    atomic_store(&record->in_use, false);
+}
+
+static void make_record_key() {
+    if (pthread_key_create(&record_key, release_record) != 0)
+        syserr("key create failed");
+}
+
+static EpochRecord *get_record() {
+    if (local_record)
+        return local_record;
+
+    if (pthread_once(&record_key_once, make_record_key) != 0)
+        syserr("once failed");
+
+    EpochRecord *record = NULL;
+    for (EpochRecord *r = atomic_load(&records); r && !record; r = r->next) {
+        bool expected = false;
+        if (!atomic_load(&r->in_use) && atomic_compare_exchange_strong(&r->in_use, &expected, true))
+            record = r;
+    }
+
+    if (!record) {
+        record = (EpochRecord *) calloc(1, sizeof(EpochRecord));
+        if (!record)
+            fatal("out of memory");
+        if (pthread_mutex_init(&record->limbo_lock, 0) != 0)
+            syserr("mutex init failed");
+        atomic_init(&record->in_use, true);
+        EpochRecord *head = atomic_load(&records);
+        do {
+            record->next = head;
+        } while (!atomic_compare_exchange_weak(&records, &head, record));
+    }
+
+    if (pthread_setspecific(record_key, record) != 0)
+        syserr("setspecific failed");
+    local_record = record;
+    return record;
+}
+
+void epoch_enter() {
+    EpochRecord *record = get_record();
+    if (record->nesting++ == 0) {
+        atomic_store(&record->state, (atomic_load(&global_epoch) << 1) | 1);
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+}
+
+void epoch_exit() {
+    EpochRecord *record = local_record;
+    if (--record->nesting == 0)
+        atomic_store_explicit(&record->state, 0, memory_order_release);
+}
+
+/* Advances the global epoch if every active thread has observed the current one. */
+static bool try_advance() {
+    unsigned long epoch = atomic_load(&global_epoch);
+    for (EpochRecord *r = atomic_load(&records); r; r = r->next) {
+        unsigned long state = atomic_load(&r->state);
+        if ((state & 1) && (state >> 1) != epoch)
+            return false;
+    }
+    return atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+}
+
+/* Frees the memory retired by `record` that can no longer be referenced. */
+static void collect_record(EpochRecord *record) {
+    RetireList ready = { NULL, 0, 0 };
+
+    lock(&record->limbo_lock);
+    retire_list_take_ready(&record->limbo, atomic_load(&global_epoch), &ready);
+    unlock(&record->limbo_lock);
+
+    retire_list_run(&ready);
+}
+
+/* Frees the memory retired by exited threads that can no longer be referenced.
+ * If `wait` is false, gives up when another thread is already doing it. */
+static void collect_orphans(bool wait) {
+    RetireList ready = { NULL, 0, 0 };
+
+    if (wait)
+        lock(&orphans_lock);
+    else if (pthread_mutex_trylock(&orphans_lock) != 0)
+        return;
+    retire_list_take_ready(&orphans, atomic_load(&global_epoch), &ready);
+    unlock(&orphans_lock);
+
+    retire_list_run(&ready);
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+    EpochRecord *record = get_record();
+    Retired item = { ptr, free_fn, atomic_load(&global_epoch) };
+
+    lock(&record->limbo_lock);
+    retire_list_push(&record->limbo, item);
+    unlock(&record->limbo_lock);
+
+    if (++record->retired_since_collect >= RETIRE_THRESHOLD) {
+        record->retired_since_collect = 0;
+        try_advance();
+        collect_record(record);
+        collect_orphans(false);
+    }
+}
+
+void epoch_synchronize() {
+    unsigned long target = atomic_load(&global_epoch) + 2;
+    while (atomic_load(&global_epoch) < target) {
+        if (!try_advance())
+            sched_yield();
+    }
+}
+
+void epoch_barrier() {
+    epoch_synchronize();
+    for (EpochRecord *r = atomic_load(&records); r; r = r->next)
+        collect_record(r);
+    collect_orphans(true);
+}
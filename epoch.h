@@ -0,0 +1,28 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/* Epoch-based memory reclamation.
+ * Threads that read shared memory without holding a lock wrap the reads in
+ * `epoch_enter`/`epoch_exit`. Memory unlinked by a writer is passed to
+ * `epoch_retire` and is freed only once every thread that could still see it
+ * has left its critical section. */
+
+/* Starts a read-side critical section. Critical sections may be nested. */
+void epoch_enter();
+
+/* Ends a read-side critical section. */
+void epoch_exit();
+
+/* Schedules `free_fn(ptr)` to run once no critical section that started
+ * before this call is still running. */
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+/* Waits until every critical section running at the moment of the call has ended.
+ * Must not be called from within a critical section. */
+void epoch_synchronize();
+
+/* Waits for a grace period and then runs every free function retired so far,
+ * by any thread. Must not be called from within a critical section. */
+void epoch_barrier();
+
+#endif //EPOCH_H
@@ -5,23 +5,142 @@
 #include <stdlib.h>
 #include <string.h>
 
-bool is_path_valid(const char* path)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Bit i of a mask refers to the i-th character of a block.
+#if defined(__AVX2__)
+#define BLOCK_WIDTH 32
+typedef uint32_t BlockMask;
+#else
+#define BLOCK_WIDTH 16
+typedef uint16_t BlockMask;
+#endif
+
+// Find the separators in a block of BLOCK_WIDTH characters of a path, and whether all of them
+// are either separators or 'a'-'z' letters.
+static inline BlockMask scan_block(const char* block, bool* valid)
+{
+#if defined(__AVX2__)
+    __m256i chars = _mm256_loadu_si256((const __m256i*)block);
+    __m256i slashes = _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('/'));
+    // Letters are shifted to the bottom of the signed range, so that a single signed comparison
+    // tells them apart.
+    __m256i shifted = _mm256_add_epi8(chars, _mm256_set1_epi8((char)(-128 - 'a')));
+    __m256i letters = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), shifted);
+    *valid = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(slashes, letters)) == 0xffffffffu;
+    return _mm256_movemask_epi8(slashes);
+#elif defined(__SSE2__)
+    __m128i chars = _mm_loadu_si128((const __m128i*)block);
+    __m128i slashes = _mm_cmpeq_epi8(chars, _mm_set1_epi8('/'));
+    __m128i shifted = _mm_add_epi8(chars, _mm_set1_epi8((char)(-128 - 'a')));
+    __m128i letters = _mm_cmplt_epi8(shifted, _mm_set1_epi8(-128 + 26));
+    *valid = _mm_movemask_epi8(_mm_or_si128(slashes, letters)) == 0xffff;
+    return _mm_movemask_epi8(slashes);
+#else
+    BlockMask mask = 0;
+    *valid = true;
+    for (int i = 0; i < BLOCK_WIDTH; ++i) {
+        if (block[i] == '/')
+            mask |= (BlockMask)1 << i;
+        else if (block[i] < 'a' || block[i] > 'z')
+            *valid = false;
+    }
+    return mask;
+#endif
+}
+
+// Check the components ending at the separators in `mask`, whose bit 0 refers to `position`,
+// and store them in `tokens` unless it's NULL. `*start` is the position of the current component.
+// Returns whether they're all valid.
+static bool add_components(const char* path, size_t position, BlockMask mask, size_t* start,
+                           PathTokens* tokens)
+{
+    for (; mask; mask &= mask - 1) {
+        size_t end = position + __builtin_ctz(mask);
+        size_t length = end - *start;
+        if (length == 0 || length > MAX_FOLDER_NAME_LENGTH)
+            return false;
+        if (tokens) {
+            PathComponent* component = &tokens->components[tokens->depth++];
+            component->hash = hmap_hash(path + *start, length);
+            component->offset = *start;
+            component->length = length;
+        }
+        *start = end + 1;
+    }
+    return true;
+}
+
+// Validate `path`, splitting it into `tokens` unless it's NULL.
+static bool scan_path(const char* path, PathTokens* tokens)
 {
     size_t len = strlen(path);
     if (len == 0 || len > MAX_PATH_LENGTH)
         return false;
     if (path[0] != '/' || path[len - 1] != '/')
         return false;
-    const char* name_start = path + 1; // Start of current path component, just after '/'.
-    while (name_start < path + len) {
-        char* name_end = strchr(name_start, '/'); // End of current path component, at '/'.
-        if (!name_end || name_end == name_start || name_end > name_start + MAX_FOLDER_NAME_LENGTH)
-            return false;
-        for (const char* p = name_start; p != name_end; ++p)
-            if (*p < 'a' || *p > 'z')
+
+    if (tokens) {
+        tokens->path = path;
+        tokens->length = len;
+        tokens->depth = 0;
+        tokens->components = tokens->inline_components;
+        // Paths are rarely that deep, so the components are simply moved to the heap.
+        if (len / 2 > PATH_TOKENS_INLINE_DEPTH) {
+            tokens->components = malloc((len / 2) * sizeof(PathComponent));
+            if (!tokens->components)
                 return false;
-        name_start = name_end + 1;
+        }
+    }
+
+    // The first separator is the root, which ends no component.
+    size_t start = 1, position = 1;
+    bool valid = true;
+    for (; valid && position + BLOCK_WIDTH <= len; position += BLOCK_WIDTH) {
+        BlockMask mask = scan_block(path + position, &valid);
+        valid = valid && add_components(path, position, mask, &start, tokens);
     }
+    for (; valid && position < len; ++position) {
+        if (path[position] == '/')
+            valid = add_components(path, position, 1, &start, tokens);
+        else
+            valid = path[position] >= 'a' && path[position] <= 'z';
+    }
+
+    if (!valid && tokens)
+        path_tokens_destroy(tokens);
+    return valid;
+}
+
+bool is_path_valid(const char* path)
+{
+    return scan_path(path, NULL);
+}
+
+bool tokenize_path(const char* path, PathTokens* tokens)
+{
+    return scan_path(path, tokens);
+}
+
+void path_tokens_destroy(PathTokens* tokens)
+{
+    if (tokens->components != tokens->inline_components)
+        free(tokens->components);
+    tokens->components = tokens->inline_components;
+}
+
+bool is_name_valid(const char* name)
+{
+    size_t len = strlen(name);
+    if (len == 0 || len > MAX_FOLDER_NAME_LENGTH)
+        return false;
+    for (const char* p = name; *p; ++p)
+        if (*p < 'a' || *p > 'z')
+            return false;
     return true;
 }
 
@@ -1,10 +1,14 @@
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "HashMap.h"
 
 // Max length of path (excluding terminating null character).
 #define MAX_PATH_LENGTH 4095
 
+// Max number of components in a valid path.
+#define MAX_PATH_DEPTH ((MAX_PATH_LENGTH - 1) / 2)
+
 // Max length of folder name (excluding terminating null character).
 #define MAX_FOLDER_NAME_LENGTH 255
 
@@ -14,6 +18,48 @@
 // sequences of 'a'-'z' ASCII characters, of length from 1 to MAX_FOLDER_NAME_LENGTH.
 bool is_path_valid(const char* path);
 
+// A component of a path, as found by `tokenize_path`.
+typedef struct PathComponent {
+    uint64_t hash; // Of the folder name, as computed by `hmap_hash`.
+    uint16_t offset; // Of the folder name in the path.
+    uint16_t length; // Of the folder name.
+} PathComponent;
+
+// How many components of a path are stored without allocating memory.
+#define PATH_TOKENS_INLINE_DEPTH 32
+
+// A valid path split into its components, which point into the path instead of copying it.
+// Tokens must not be copied, as they may point into themselves.
+typedef struct PathTokens {
+    const char* path;
+    size_t length; // Of `path`.
+    size_t depth; // Number of components.
+    PathComponent* components;
+    PathComponent inline_components[PATH_TOKENS_INLINE_DEPTH];
+} PathTokens;
+
+// Validate `path` and split it into `tokens` in a single pass, checking many characters at once
+// with SSE2 or AVX2 where available. Returns whether the path is valid (see `is_path_valid`).
+// If it is, `tokens` should be destroyed with `path_tokens_destroy` once no longer needed,
+// and `path` must stay valid until then.
+bool tokenize_path(const char* path, PathTokens* tokens);
+
+// Free the memory of `tokens`.
+void path_tokens_destroy(PathTokens* tokens);
+
+// Return the length of the subpath made of the first `depth` components of `tokens`,
+// itself a valid path.
+static inline size_t path_tokens_prefix(const PathTokens* tokens, size_t depth)
+{
+    if (depth == 0)
+        return 1;
+    const PathComponent* last = &tokens->components[depth - 1];
+    return last->offset + last->length + 1;
+}
+
+// Return whether `name` is a valid folder name (see `is_path_valid`).
+bool is_name_valid(const char* name);
+
 // Return the subpath obtained by removing the first component.
 // Args:
 // - `path`: should be a valid path (see `is_path_valid`).